@@ -2,6 +2,9 @@
 
 #include "chacha_detail.hpp"
 
+#include <thread>
+#include <vector>
+
 namespace chacha
 {
 	template <std::size_t KeyBits>
@@ -28,12 +31,34 @@ namespace chacha
 	class buffered_cipher;
 	/* 
 	 * buffered_cipher(key_bits<KeyBits> kb, const void* key_data, std::uint64_t nonce);
+	 * void set_block_index(std::uint64_t block_index);
 	 * void transform(cipher_rounds rounds, void* buffer, const void* source, std::size_t bytes);
 	 * 
 	 * For this cipher, transform works like a continuous byte stream. It doesn't matter
 	 * if you make three calls to transform() with 10, 10 and 20 bytes or two calls 
 	 * to transform() with 20 and 20 bytes, thre result will be the same.
 	 * The block index will be increased as necessary.
+	 * set_block_index() discards any buffered key stream.
+	 */
+
+	/*
+	 * void parallel_transform(key_bits<KeyBits> kb, const void* key_data, std::uint64_t nonce,
+	 *		std::uint64_t start_block, void* buffer, const void* source, std::size_t bytes,
+	 *		std::size_t threads);
+	 * 
+	 * Same result as a single transform() call of a buffered_cipher that was set to
+	 * start_block, but splits the work into chunks of whole 192 byte groups
+	 * and runs them on up to threads threads (including the calling one).
+	 */
+
+	/*
+	 * struct transform_span { std::uint64_t nonce; std::uint64_t block_index; void* buffer; std::size_t bytes; };
+	 * void batch_transform(key_bits<KeyBits> kb, const void* key_data,
+	 *		const transform_span* spans, std::size_t count);
+	 * 
+	 * Transforms every span in place, with the same result as a separate unbuffered_cipher
+	 * for each one that was set to its nonce and block index. Blocks of different spans
+	 * are computed side by side, so many short spans cost about as much as one long one.
 	 */
 
 
@@ -72,10 +97,25 @@ namespace chacha
 			auto buf_ptr = static_cast<std::uint8_t*>(buffer);
 			auto src_ptr = static_cast<const std::uint8_t*>(source);
 
-			for (; bytes >= 192; bytes -= 192, buf_ptr += 192, src_ptr += 192)
+			// The trailing bytes get processed in groups of 3 blocks, which determines
+			// by how much the block index advances. Wider kernels are only used before
+			// that point, so the keystream stays the same no matter which one is used.
+			const auto bulk_bytes = bytes / 192 * 192;
+			auto processed = detail::transform_xor_wide(_keypad, rounds.rounds, buf_ptr, src_ptr, bulk_bytes);
+
+			for (; bulk_bytes - processed >= 192; processed += 192)
 			{
-				detail::transform_xor_3_blocks(_keypad, rounds.rounds, buf_ptr, src_ptr);
+				detail::transform_xor_3_blocks(_keypad, rounds.rounds, buf_ptr + processed, src_ptr + processed);
 			}
+
+			for (; processed < bulk_bytes; processed += 64)
+			{
+				detail::transform_xor(_keypad, rounds.rounds, buf_ptr + processed, src_ptr + processed);
+			}
+
+			bytes -= bulk_bytes;
+			buf_ptr += bulk_bytes;
+			src_ptr += bulk_bytes;
 			
 			if (bytes > 0)
 			{
@@ -115,6 +155,12 @@ namespace chacha
 			: _cipher(kb, key_data, nonce)
 		{}
 
+		void set_block_index(std::uint64_t block_index)
+		{
+			_cipher.set_block_index(block_index);
+			_space = 0;
+		}
+
 		void transform(void* buffer, const void* source, std::size_t bytes)
 		{
 			transform(cipher_rounds::make<20>(), buffer, source, bytes);
@@ -160,4 +206,140 @@ namespace chacha
 			}
 		}
 	};
+
+	template <std::size_t KeyBits>
+	void parallel_transform(cipher_rounds rounds, key_bits<KeyBits> kb, const void* key_data, 
+		std::uint64_t nonce, std::uint64_t start_block, void* buffer, const void* source, 
+		std::size_t bytes, std::size_t threads)
+	{
+		// Chunks smaller than this aren't worth starting a thread for.
+		constexpr std::size_t min_chunk_size = 64 * 1024;
+
+		// Chunks have to start at multiples of 192 bytes, otherwise the
+		// block index would advance differently than in a single call.
+		const auto groups = (bytes + 191) / 192;
+		const auto max_threads = std::max(std::size_t{ 1 }, bytes / min_chunk_size);
+		threads = std::max(std::size_t{ 1 }, std::min({ threads, max_threads, groups }));
+		const auto chunk_size = (groups + threads - 1) / threads * 192;
+
+		const auto transform_chunk = [&](std::size_t offset)
+		{
+			// The counter is only 32 bits wide inside the cipher, so it wraps around
+			// without carrying into the upper half, just like it does in a single call.
+			const auto block_index = (start_block & 0xFFFFFFFF00000000u) 
+				| ((start_block + offset / 64) & 0xFFFFFFFFu);
+
+			buffered_cipher cipher(kb, key_data, nonce);
+			cipher.set_block_index(block_index);
+			cipher.transform(rounds, static_cast<std::uint8_t*>(buffer) + offset,
+				static_cast<const std::uint8_t*>(source) + offset, std::min(chunk_size, bytes - offset));
+			detail::volatile_zero_memory(&cipher, sizeof cipher);
+		};
+
+		std::vector<std::thread> workers;
+		workers.reserve(threads - 1);
+		std::size_t offset = chunk_size;
+
+		try
+		{
+			for (; offset < bytes; offset += chunk_size)
+			{
+				workers.emplace_back(transform_chunk, offset);
+			}
+		}
+		catch (...)
+		{ // Couldn't start another thread, the remaining chunks are done on this one.
+		}
+
+		for (auto rest = offset; rest < bytes; rest += chunk_size)
+		{
+			transform_chunk(rest);
+		}
+
+		transform_chunk(0);
+
+		for (auto& worker : workers)
+		{
+			worker.join();
+		}
+	}
+
+	template <std::size_t KeyBits>
+	void parallel_transform(key_bits<KeyBits> kb, const void* key_data, std::uint64_t nonce, 
+		std::uint64_t start_block, void* buffer, const void* source, std::size_t bytes, std::size_t threads)
+	{
+		parallel_transform(cipher_rounds::make<20>(), kb, key_data, nonce, start_block, buffer, source, bytes, threads);
+	}
+
+	struct transform_span
+	{
+		std::uint64_t nonce;
+		std::uint64_t block_index;
+		void* buffer;
+		std::size_t bytes;
+	};
+
+	template <std::size_t KeyBits>
+	void batch_transform(cipher_rounds rounds, key_bits<KeyBits>, const void* key_data,
+		const transform_span* spans, std::size_t count)
+	{
+		constexpr auto lanes = detail::batch_lanes;
+
+		auto keypad = detail::key_iv_setup<KeyBits>(key_data, 0);
+		alignas(32) std::array<std::uint32_t, 4 * lanes> tails = {};
+		alignas(32) std::array<std::uint8_t, 64 * lanes> key_stream;
+		std::array<std::uint8_t*, lanes> targets;
+		std::array<std::size_t, lanes> sizes;
+		std::size_t used = 0;
+
+		const auto flush = [&]
+		{
+			// Unused lanes keep whatever they held before, their blocks get ignored.
+			detail::keystream_batch(keypad, rounds.rounds, tails.data(), key_stream.data());
+
+			for (std::size_t i = 0; i < used; ++i)
+			{
+				detail::memxor(targets[i], targets[i], key_stream.data() + 64 * i, sizes[i]);
+			}
+
+			used = 0;
+		};
+
+		for (std::size_t j = 0; j < count; ++j)
+		{
+			const auto& span = spans[j];
+			const auto buf_ptr = static_cast<std::uint8_t*>(span.buffer);
+
+			for (std::size_t offset = 0; offset < span.bytes; offset += 64)
+			{
+				// The counter is only 32 bits wide inside the cipher, it wraps around
+				// without carrying into the upper half.
+				tails[0 * lanes + used] = static_cast<std::uint32_t>(span.block_index + offset / 64);
+				tails[1 * lanes + used] = static_cast<std::uint32_t>(span.block_index >> 32);
+				tails[2 * lanes + used] = static_cast<std::uint32_t>(span.nonce);
+				tails[3 * lanes + used] = static_cast<std::uint32_t>(span.nonce >> 32);
+				targets[used] = buf_ptr + offset;
+				sizes[used] = std::min(std::size_t{ 64 }, span.bytes - offset);
+
+				if (++used == lanes)
+				{
+					flush();
+				}
+			}
+		}
+
+		if (used > 0)
+		{
+			flush();
+		}
+
+		detail::volatile_zero_memory(&key_stream, sizeof key_stream);
+		detail::volatile_zero_memory(&keypad, sizeof keypad);
+	}
+
+	template <std::size_t KeyBits>
+	void batch_transform(key_bits<KeyBits> kb, const void* key_data, const transform_span* spans, std::size_t count)
+	{
+		batch_transform(cipher_rounds::make<20>(), kb, key_data, spans, count);
+	}
 }
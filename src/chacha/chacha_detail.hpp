@@ -1,11 +1,13 @@
 #pragma once
 
+#include <climits>
 #include <cstddef>
 #include <cstdint>
 #include <cstring>
 
 #include <algorithm>
 #include <array>
+#include <limits>
 
 #if defined(__SSE2__) || (defined(_MSC_VER) && (defined(_M_X64) || _M_IX86_FP == 2))
 #define CHACHA_SSE2_AVAILABLE
@@ -14,6 +16,31 @@
 #endif
 #endif
 
+// The AVX2 and AVX-512 kernels are compiled regardless of the target architecture
+// flags and only selected at runtime, so one binary still runs on older machines.
+// VS2015 doesn't ship the AVX-512 intrinsics, hence the version check.
+#if defined(CHACHA_SSSE3_AVAILABLE)
+#define CHACHA_AVX2_AVAILABLE
+#if !defined(_MSC_VER) || _MSC_VER >= 1911
+#define CHACHA_AVX512_AVAILABLE
+#endif
+#endif
+
+#if defined(CHACHA_SSE2_AVAILABLE)
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
+#endif
+
+#if defined(_MSC_VER) && !defined(__clang__)
+#define CHACHA_TARGET(isa)
+#else
+#define CHACHA_TARGET(isa) __attribute__((target(isa)))
+#endif
+
 namespace chacha
 {
 	namespace detail
@@ -55,6 +82,14 @@ namespace chacha
 			return state;
 		}
 
+		static void volatile_zero_memory(volatile void* ptr, std::size_t bytes)
+		{
+			for (auto byte_ptr = static_cast<volatile std::uint8_t*>(ptr); bytes-- > 0; ++byte_ptr)
+			{
+				*byte_ptr = 0;
+			}
+		}
+
 		void memxor(void* buffer, const void* source0, const void* source1, std::size_t bytes)
 		{
 			auto buf_ptr = static_cast<std::uint8_t*>(buffer);
@@ -179,6 +214,16 @@ namespace chacha
 		 * 
 		 */
 
+		/* Blocks of independent states
+		 * 
+		 * The batch kernels compute one block for each of batch_lanes states which share
+		 * words 0 to 11 (constants and key) but not words 12 to 15 (counter and nonce).
+		 * tails[w * batch_lanes + i] holds word 12 + w of state i, the block of state i
+		 * gets stored at out + 64 * i.
+		 */
+
+		constexpr std::size_t batch_lanes = 8;
+
 #if !defined(CHACHA_SSE2_AVAILABLE)
 		static void transform_xor_3_blocks(keypad_state& key, std::size_t rounds, void* buffer, const void* source)
 		{
@@ -189,6 +234,25 @@ namespace chacha
 			transform_xor(key, rounds, buf_ptr + 64, src_ptr + 64);
 			transform_xor(key, rounds, buf_ptr + 128, src_ptr + 128);
 		}
+
+		static void keystream_batch_generic(const keypad_state& key, std::size_t rounds,
+			const std::uint32_t* tails, std::uint8_t* out)
+		{
+			auto state = key;
+
+			for (std::size_t i = 0; i < batch_lanes; ++i)
+			{
+				for (std::size_t w = 0; w < 4; ++w)
+				{
+					state.data[12 + w] = tails[w * batch_lanes + i];
+				}
+
+				std::memset(out + 64 * i, 0x00, 64);
+				transform_xor(state, rounds, out + 64 * i, out + 64 * i);
+			}
+
+			volatile_zero_memory(&state, sizeof state);
+		}
 #else
 		static __m128i pshufd1(__m128i v0)
 		{
@@ -342,6 +406,700 @@ namespace chacha
 
 			_mm_store_si128(key_ptr + 3, k3);
 		}
+
+		static void qround_128(__m128i& v0, __m128i& v1, __m128i& v2, __m128i& v3)
+		{
+			v0 = _mm_add_epi32(v0, v1);
+			v3 = prold<16>(_mm_xor_si128(v3, v0));
+			v2 = _mm_add_epi32(v2, v3);
+			v1 = prold<12>(_mm_xor_si128(v1, v2));
+			v0 = _mm_add_epi32(v0, v1);
+			v3 = prold<8>(_mm_xor_si128(v3, v0));
+			v2 = _mm_add_epi32(v2, v3);
+			v1 = prold<7>(_mm_xor_si128(v1, v2));
+		}
+
+		static void transpose_4x4(__m128i& v0, __m128i& v1, __m128i& v2, __m128i& v3)
+		{
+			const auto t0 = _mm_unpacklo_epi32(v0, v1);
+			const auto t1 = _mm_unpackhi_epi32(v0, v1);
+			const auto t2 = _mm_unpacklo_epi32(v2, v3);
+			const auto t3 = _mm_unpackhi_epi32(v2, v3);
+
+			v0 = _mm_unpacklo_epi64(t0, t2);
+			v1 = _mm_unpackhi_epi64(t0, t2);
+			v2 = _mm_unpacklo_epi64(t1, t3);
+			v3 = _mm_unpackhi_epi64(t1, t3);
+		}
+
+		// Computes the blocks of 4 of the batch_lanes states, every register holds the same word of all 4.
+		static void keystream_4_states(const keypad_state& key, std::size_t rounds,
+			const std::uint32_t* tails, std::uint8_t* out)
+		{
+			const auto tail_ptr = reinterpret_cast<const __m128i*>(tails);
+			const auto buf_ptr = reinterpret_cast<__m128i*>(out);
+
+			const auto k12 = _mm_loadu_si128(tail_ptr + 0 * batch_lanes / 4);
+			const auto k13 = _mm_loadu_si128(tail_ptr + 1 * batch_lanes / 4);
+			const auto k14 = _mm_loadu_si128(tail_ptr + 2 * batch_lanes / 4);
+			const auto k15 = _mm_loadu_si128(tail_ptr + 3 * batch_lanes / 4);
+
+			auto v0 = _mm_set1_epi32(static_cast<int>(key.data[0]));
+			auto v1 = _mm_set1_epi32(static_cast<int>(key.data[1]));
+			auto v2 = _mm_set1_epi32(static_cast<int>(key.data[2]));
+			auto v3 = _mm_set1_epi32(static_cast<int>(key.data[3]));
+			auto v4 = _mm_set1_epi32(static_cast<int>(key.data[4]));
+			auto v5 = _mm_set1_epi32(static_cast<int>(key.data[5]));
+			auto v6 = _mm_set1_epi32(static_cast<int>(key.data[6]));
+			auto v7 = _mm_set1_epi32(static_cast<int>(key.data[7]));
+			auto v8 = _mm_set1_epi32(static_cast<int>(key.data[8]));
+			auto v9 = _mm_set1_epi32(static_cast<int>(key.data[9]));
+			auto v10 = _mm_set1_epi32(static_cast<int>(key.data[10]));
+			auto v11 = _mm_set1_epi32(static_cast<int>(key.data[11]));
+			auto v12 = k12;
+			auto v13 = k13;
+			auto v14 = k14;
+			auto v15 = k15;
+
+			// assert(rounds % 2 == 0) // Gets enforced through higher level compile-time check.
+			for (std::size_t i = rounds / 2; i-- > 0; )
+			{
+				qround_128(v0, v4, v8, v12);
+				qround_128(v1, v5, v9, v13);
+				qround_128(v2, v6, v10, v14);
+				qround_128(v3, v7, v11, v15);
+
+				qround_128(v0, v5, v10, v15);
+				qround_128(v1, v6, v11, v12);
+				qround_128(v2, v7, v8, v13);
+				qround_128(v3, v4, v9, v14);
+			}
+
+			v0 = _mm_add_epi32(v0, _mm_set1_epi32(static_cast<int>(key.data[0])));
+			v1 = _mm_add_epi32(v1, _mm_set1_epi32(static_cast<int>(key.data[1])));
+			v2 = _mm_add_epi32(v2, _mm_set1_epi32(static_cast<int>(key.data[2])));
+			v3 = _mm_add_epi32(v3, _mm_set1_epi32(static_cast<int>(key.data[3])));
+			v4 = _mm_add_epi32(v4, _mm_set1_epi32(static_cast<int>(key.data[4])));
+			v5 = _mm_add_epi32(v5, _mm_set1_epi32(static_cast<int>(key.data[5])));
+			v6 = _mm_add_epi32(v6, _mm_set1_epi32(static_cast<int>(key.data[6])));
+			v7 = _mm_add_epi32(v7, _mm_set1_epi32(static_cast<int>(key.data[7])));
+			v8 = _mm_add_epi32(v8, _mm_set1_epi32(static_cast<int>(key.data[8])));
+			v9 = _mm_add_epi32(v9, _mm_set1_epi32(static_cast<int>(key.data[9])));
+			v10 = _mm_add_epi32(v10, _mm_set1_epi32(static_cast<int>(key.data[10])));
+			v11 = _mm_add_epi32(v11, _mm_set1_epi32(static_cast<int>(key.data[11])));
+			v12 = _mm_add_epi32(v12, k12);
+			v13 = _mm_add_epi32(v13, k13);
+			v14 = _mm_add_epi32(v14, k14);
+			v15 = _mm_add_epi32(v15, k15);
+
+			// Afterwards v(4 * i + j) holds words 4 * i to 4 * i + 3 of block j.
+			transpose_4x4(v0, v1, v2, v3);
+			transpose_4x4(v4, v5, v6, v7);
+			transpose_4x4(v8, v9, v10, v11);
+			transpose_4x4(v12, v13, v14, v15);
+
+			_mm_storeu_si128(buf_ptr + 0, v0);
+			_mm_storeu_si128(buf_ptr + 1, v4);
+			_mm_storeu_si128(buf_ptr + 2, v8);
+			_mm_storeu_si128(buf_ptr + 3, v12);
+			_mm_storeu_si128(buf_ptr + 4, v1);
+			_mm_storeu_si128(buf_ptr + 5, v5);
+			_mm_storeu_si128(buf_ptr + 6, v9);
+			_mm_storeu_si128(buf_ptr + 7, v13);
+			_mm_storeu_si128(buf_ptr + 8, v2);
+			_mm_storeu_si128(buf_ptr + 9, v6);
+			_mm_storeu_si128(buf_ptr + 10, v10);
+			_mm_storeu_si128(buf_ptr + 11, v14);
+			_mm_storeu_si128(buf_ptr + 12, v3);
+			_mm_storeu_si128(buf_ptr + 13, v7);
+			_mm_storeu_si128(buf_ptr + 14, v11);
+			_mm_storeu_si128(buf_ptr + 15, v15);
+		}
+#endif
+
+		/* Runtime CPU feature detection
+		 * 
+		 */
+
+		struct cpu_features
+		{
+			bool avx2 = false;
+			bool avx512f = false;
+		};
+
+#if defined(CHACHA_AVX2_AVAILABLE)
+		static void cpuid(std::uint32_t (&regs)[4], std::uint32_t leaf, std::uint32_t subleaf)
+		{
+#if defined(_MSC_VER)
+			int info[4];
+			__cpuidex(info, static_cast<int>(leaf), static_cast<int>(subleaf));
+			std::memcpy(regs, info, sizeof regs);
+#else
+			__cpuid_count(leaf, subleaf, regs[0], regs[1], regs[2], regs[3]);
+#endif
+		}
+
+		static std::uint64_t xgetbv0()
+		{
+#if defined(_MSC_VER)
+			return _xgetbv(0);
+#else
+			std::uint32_t lo;
+			std::uint32_t hi;
+			__asm__ __volatile__("xgetbv" : "=a"(lo), "=d"(hi) : "c"(0));
+			return static_cast<std::uint64_t>(hi) << 32 | lo;
+#endif
+		}
+#endif
+
+		static cpu_features detect_cpu_features()
+		{
+			cpu_features features;
+
+#if defined(CHACHA_AVX2_AVAILABLE)
+			std::uint32_t regs[4];
+			cpuid(regs, 0, 0);
+
+			if (regs[0] < 7)
+			{
+				return features;
+			}
+
+			cpuid(regs, 1, 0);
+
+			const bool osxsave = (regs[2] & (1u << 27)) != 0;
+			const bool avx = (regs[2] & (1u << 28)) != 0;
+
+			if (!osxsave || !avx)
+			{
+				return features;
+			}
+
+			// The OS has to save the ymm (and zmm/opmask) registers on context switches.
+			const auto xcr0 = xgetbv0();
+			cpuid(regs, 7, 0);
+
+			features.avx2 = (xcr0 & 0x06) == 0x06 && (regs[1] & (1u << 5)) != 0;
+			features.avx512f = (xcr0 & 0xE6) == 0xE6 && (regs[1] & (1u << 16)) != 0;
 #endif
+
+			return features;
+		}
+
+		static const cpu_features& cpu()
+		{
+			static const cpu_features features = detect_cpu_features();
+			return features;
+		}
+
+		/* AVX2/AVX-512 implementations
+		 * 
+		 * transform_xor_4_blocks() works like transform_xor_3_blocks(), with two
+		 * blocks per register. The wider kernels hold the same state word of 8 or 16
+		 * consecutive blocks in every register, so the rounds don't need any shuffles.
+		 * Their result gets transposed back into block order before it's xored into
+		 * the buffer. The counter is incremented exactly like in transform_xor(),
+		 * so the keystream is the same for all kernels.
+		 */
+
+#if defined(CHACHA_AVX2_AVAILABLE)
+		template <int N>
+		CHACHA_TARGET("avx2") static __m256i prold_256(__m256i v0)
+		{
+			if (N == 16)
+			{
+				return _mm256_shuffle_epi8(v0, _mm256_set_epi8(
+					13, 12, 15, 14, 9, 8, 11, 10, 5, 4, 7, 6, 1, 0, 3, 2,
+					13, 12, 15, 14, 9, 8, 11, 10, 5, 4, 7, 6, 1, 0, 3, 2));
+			}
+
+			if (N == 8)
+			{
+				return _mm256_shuffle_epi8(v0, _mm256_set_epi8(
+					14, 13, 12, 15, 10, 9, 8, 11, 6, 5, 4, 7, 2, 1, 0, 3,
+					14, 13, 12, 15, 10, 9, 8, 11, 6, 5, 4, 7, 2, 1, 0, 3));
+			}
+
+			return _mm256_or_si256(_mm256_slli_epi32(v0, N), _mm256_srli_epi32(v0, 32 - N));
+		}
+
+		template <int N>
+		CHACHA_TARGET("avx2") static void double_qround_256(
+			__m256i& v0, __m256i& v1, __m256i& v3,
+			__m256i& v4, __m256i& v5, __m256i& v7)
+		{
+			v0 = _mm256_add_epi32(v0, v1);
+			v4 = _mm256_add_epi32(v4, v5);
+
+			v3 = _mm256_xor_si256(v3, v0);
+			v7 = _mm256_xor_si256(v7, v4);
+
+			v3 = prold_256<N>(v3);
+			v7 = prold_256<N>(v7);
+		}
+
+		CHACHA_TARGET("avx2") static void transform_xor_4_blocks(
+			keypad_state& key, std::size_t rounds, void* buffer, const void* source)
+		{
+			const auto key_ptr = reinterpret_cast<const __m128i*>(key.data.data());
+			const auto buf_ptr = static_cast<__m256i*>(buffer);
+			const auto src_ptr = static_cast<const __m256i*>(source);
+
+			// Low lanes hold the even blocks, high lanes the odd ones.
+			const auto k0 = _mm256_broadcastsi128_si256(_mm_load_si128(key_ptr + 0));
+			const auto k1 = _mm256_broadcastsi128_si256(_mm_load_si128(key_ptr + 1));
+			const auto k2 = _mm256_broadcastsi128_si256(_mm_load_si128(key_ptr + 2));
+			const auto k3 = _mm256_add_epi32(_mm256_broadcastsi128_si256(
+				_mm_load_si128(key_ptr + 3)), _mm256_set_epi32(0, 0, 0, 1, 0, 0, 0, 0));
+			const auto k7 = _mm256_add_epi32(k3, _mm256_set_epi32(0, 0, 0, 2, 0, 0, 0, 2));
+
+			auto v0 = k0;
+			auto v1 = k1;
+			auto v2 = k2;
+			auto v3 = k3;
+
+			auto v4 = k0;
+			auto v5 = k1;
+			auto v6 = k2;
+			auto v7 = k7;
+
+			// assert(rounds % 2 == 0) // Gets enforced through higher level compile-time check.
+			for (std::size_t i = rounds / 2; i-- > 0; )
+			{
+				double_qround_256<16>(v0, v1, v3, v4, v5, v7);
+				double_qround_256<12>(v2, v3, v1, v6, v7, v5);
+				double_qround_256<8>(v0, v1, v3, v4, v5, v7);
+				double_qround_256<7>(v2, v3, v1, v6, v7, v5);
+
+				v1 = _mm256_shuffle_epi32(v1, _MM_SHUFFLE(0, 3, 2, 1));
+				v2 = _mm256_shuffle_epi32(v2, _MM_SHUFFLE(1, 0, 3, 2));
+				v3 = _mm256_shuffle_epi32(v3, _MM_SHUFFLE(2, 1, 0, 3));
+				v5 = _mm256_shuffle_epi32(v5, _MM_SHUFFLE(0, 3, 2, 1));
+				v6 = _mm256_shuffle_epi32(v6, _MM_SHUFFLE(1, 0, 3, 2));
+				v7 = _mm256_shuffle_epi32(v7, _MM_SHUFFLE(2, 1, 0, 3));
+
+				double_qround_256<16>(v0, v1, v3, v4, v5, v7);
+				double_qround_256<12>(v2, v3, v1, v6, v7, v5);
+				double_qround_256<8>(v0, v1, v3, v4, v5, v7);
+				double_qround_256<7>(v2, v3, v1, v6, v7, v5);
+
+				v1 = _mm256_shuffle_epi32(v1, _MM_SHUFFLE(2, 1, 0, 3));
+				v2 = _mm256_shuffle_epi32(v2, _MM_SHUFFLE(1, 0, 3, 2));
+				v3 = _mm256_shuffle_epi32(v3, _MM_SHUFFLE(0, 3, 2, 1));
+				v5 = _mm256_shuffle_epi32(v5, _MM_SHUFFLE(2, 1, 0, 3));
+				v6 = _mm256_shuffle_epi32(v6, _MM_SHUFFLE(1, 0, 3, 2));
+				v7 = _mm256_shuffle_epi32(v7, _MM_SHUFFLE(0, 3, 2, 1));
+			}
+
+			v0 = _mm256_add_epi32(v0, k0);
+			v1 = _mm256_add_epi32(v1, k1);
+			v2 = _mm256_add_epi32(v2, k2);
+			v3 = _mm256_add_epi32(v3, k3);
+
+			v4 = _mm256_add_epi32(v4, k0);
+			v5 = _mm256_add_epi32(v5, k1);
+			v6 = _mm256_add_epi32(v6, k2);
+			v7 = _mm256_add_epi32(v7, k7);
+
+			_mm256_storeu_si256(buf_ptr + 0, _mm256_xor_si256(
+				_mm256_permute2x128_si256(v0, v1, 0x20), _mm256_loadu_si256(src_ptr + 0)));
+			_mm256_storeu_si256(buf_ptr + 1, _mm256_xor_si256(
+				_mm256_permute2x128_si256(v2, v3, 0x20), _mm256_loadu_si256(src_ptr + 1)));
+			_mm256_storeu_si256(buf_ptr + 2, _mm256_xor_si256(
+				_mm256_permute2x128_si256(v0, v1, 0x31), _mm256_loadu_si256(src_ptr + 2)));
+			_mm256_storeu_si256(buf_ptr + 3, _mm256_xor_si256(
+				_mm256_permute2x128_si256(v2, v3, 0x31), _mm256_loadu_si256(src_ptr + 3)));
+			_mm256_storeu_si256(buf_ptr + 4, _mm256_xor_si256(
+				_mm256_permute2x128_si256(v4, v5, 0x20), _mm256_loadu_si256(src_ptr + 4)));
+			_mm256_storeu_si256(buf_ptr + 5, _mm256_xor_si256(
+				_mm256_permute2x128_si256(v6, v7, 0x20), _mm256_loadu_si256(src_ptr + 5)));
+			_mm256_storeu_si256(buf_ptr + 6, _mm256_xor_si256(
+				_mm256_permute2x128_si256(v4, v5, 0x31), _mm256_loadu_si256(src_ptr + 6)));
+			_mm256_storeu_si256(buf_ptr + 7, _mm256_xor_si256(
+				_mm256_permute2x128_si256(v6, v7, 0x31), _mm256_loadu_si256(src_ptr + 7)));
+
+			key.data[12] += 4;
+		}
+		CHACHA_TARGET("avx2") static void qround_256(__m256i& v0, __m256i& v1, __m256i& v2, __m256i& v3)
+		{
+			v0 = _mm256_add_epi32(v0, v1);
+			v3 = prold_256<16>(_mm256_xor_si256(v3, v0));
+			v2 = _mm256_add_epi32(v2, v3);
+			v1 = prold_256<12>(_mm256_xor_si256(v1, v2));
+			v0 = _mm256_add_epi32(v0, v1);
+			v3 = prold_256<8>(_mm256_xor_si256(v3, v0));
+			v2 = _mm256_add_epi32(v2, v3);
+			v1 = prold_256<7>(_mm256_xor_si256(v1, v2));
+		}
+
+		// Transposes the 4x4 matrices inside every 128-bit lane.
+		CHACHA_TARGET("avx2") static void transpose_4x4_256(__m256i& v0, __m256i& v1, __m256i& v2, __m256i& v3)
+		{
+			const auto t0 = _mm256_unpacklo_epi32(v0, v1);
+			const auto t1 = _mm256_unpackhi_epi32(v0, v1);
+			const auto t2 = _mm256_unpacklo_epi32(v2, v3);
+			const auto t3 = _mm256_unpackhi_epi32(v2, v3);
+
+			v0 = _mm256_unpacklo_epi64(t0, t2);
+			v1 = _mm256_unpackhi_epi64(t0, t2);
+			v2 = _mm256_unpacklo_epi64(t1, t3);
+			v3 = _mm256_unpackhi_epi64(t1, t3);
+		}
+		CHACHA_TARGET("avx2") static void xor_store_256(std::uint8_t* buffer, const std::uint8_t* source, __m256i v0)
+		{
+			_mm256_storeu_si256(reinterpret_cast<__m256i*>(buffer), 
+				_mm256_xor_si256(v0, _mm256_loadu_si256(reinterpret_cast<const __m256i*>(source))));
+		}
+
+		CHACHA_TARGET("avx2") static void transform_xor_8_blocks(
+			keypad_state& key, std::size_t rounds, void* buffer, const void* source)
+		{
+			const auto buf_ptr = static_cast<std::uint8_t*>(buffer);
+			const auto src_ptr = static_cast<const std::uint8_t*>(source);
+
+			// The counter only gets added to the lowest word, exactly like in transform_xor().
+			const auto counter = _mm256_add_epi32(
+				_mm256_set1_epi32(static_cast<int>(key.data[12])), _mm256_set_epi32(7, 6, 5, 4, 3, 2, 1, 0));
+
+			auto v0 = _mm256_set1_epi32(static_cast<int>(key.data[0]));
+			auto v1 = _mm256_set1_epi32(static_cast<int>(key.data[1]));
+			auto v2 = _mm256_set1_epi32(static_cast<int>(key.data[2]));
+			auto v3 = _mm256_set1_epi32(static_cast<int>(key.data[3]));
+			auto v4 = _mm256_set1_epi32(static_cast<int>(key.data[4]));
+			auto v5 = _mm256_set1_epi32(static_cast<int>(key.data[5]));
+			auto v6 = _mm256_set1_epi32(static_cast<int>(key.data[6]));
+			auto v7 = _mm256_set1_epi32(static_cast<int>(key.data[7]));
+			auto v8 = _mm256_set1_epi32(static_cast<int>(key.data[8]));
+			auto v9 = _mm256_set1_epi32(static_cast<int>(key.data[9]));
+			auto v10 = _mm256_set1_epi32(static_cast<int>(key.data[10]));
+			auto v11 = _mm256_set1_epi32(static_cast<int>(key.data[11]));
+			auto v12 = counter;
+			auto v13 = _mm256_set1_epi32(static_cast<int>(key.data[13]));
+			auto v14 = _mm256_set1_epi32(static_cast<int>(key.data[14]));
+			auto v15 = _mm256_set1_epi32(static_cast<int>(key.data[15]));
+
+			// assert(rounds % 2 == 0) // Gets enforced through higher level compile-time check.
+			for (std::size_t i = rounds / 2; i-- > 0; )
+			{
+				qround_256(v0, v4, v8, v12);
+				qround_256(v1, v5, v9, v13);
+				qround_256(v2, v6, v10, v14);
+				qround_256(v3, v7, v11, v15);
+
+				qround_256(v0, v5, v10, v15);
+				qround_256(v1, v6, v11, v12);
+				qround_256(v2, v7, v8, v13);
+				qround_256(v3, v4, v9, v14);
+			}
+
+			v0 = _mm256_add_epi32(v0, _mm256_set1_epi32(static_cast<int>(key.data[0])));
+			v1 = _mm256_add_epi32(v1, _mm256_set1_epi32(static_cast<int>(key.data[1])));
+			v2 = _mm256_add_epi32(v2, _mm256_set1_epi32(static_cast<int>(key.data[2])));
+			v3 = _mm256_add_epi32(v3, _mm256_set1_epi32(static_cast<int>(key.data[3])));
+			v4 = _mm256_add_epi32(v4, _mm256_set1_epi32(static_cast<int>(key.data[4])));
+			v5 = _mm256_add_epi32(v5, _mm256_set1_epi32(static_cast<int>(key.data[5])));
+			v6 = _mm256_add_epi32(v6, _mm256_set1_epi32(static_cast<int>(key.data[6])));
+			v7 = _mm256_add_epi32(v7, _mm256_set1_epi32(static_cast<int>(key.data[7])));
+			v8 = _mm256_add_epi32(v8, _mm256_set1_epi32(static_cast<int>(key.data[8])));
+			v9 = _mm256_add_epi32(v9, _mm256_set1_epi32(static_cast<int>(key.data[9])));
+			v10 = _mm256_add_epi32(v10, _mm256_set1_epi32(static_cast<int>(key.data[10])));
+			v11 = _mm256_add_epi32(v11, _mm256_set1_epi32(static_cast<int>(key.data[11])));
+			v12 = _mm256_add_epi32(v12, counter);
+			v13 = _mm256_add_epi32(v13, _mm256_set1_epi32(static_cast<int>(key.data[13])));
+			v14 = _mm256_add_epi32(v14, _mm256_set1_epi32(static_cast<int>(key.data[14])));
+			v15 = _mm256_add_epi32(v15, _mm256_set1_epi32(static_cast<int>(key.data[15])));
+
+			// Afterwards, the low lane of v(4 * i + j) holds words 4 * i to 4 * i + 3
+			// of block j, the high lane holds the same words of block j + 4.
+			transpose_4x4_256(v0, v1, v2, v3);
+			transpose_4x4_256(v4, v5, v6, v7);
+			transpose_4x4_256(v8, v9, v10, v11);
+			transpose_4x4_256(v12, v13, v14, v15);
+
+			xor_store_256(buf_ptr + 0, src_ptr + 0, _mm256_permute2x128_si256(v0, v4, 0x20));
+			xor_store_256(buf_ptr + 256, src_ptr + 256, _mm256_permute2x128_si256(v0, v4, 0x31));
+			xor_store_256(buf_ptr + 32, src_ptr + 32, _mm256_permute2x128_si256(v8, v12, 0x20));
+			xor_store_256(buf_ptr + 288, src_ptr + 288, _mm256_permute2x128_si256(v8, v12, 0x31));
+			xor_store_256(buf_ptr + 64, src_ptr + 64, _mm256_permute2x128_si256(v1, v5, 0x20));
+			xor_store_256(buf_ptr + 320, src_ptr + 320, _mm256_permute2x128_si256(v1, v5, 0x31));
+			xor_store_256(buf_ptr + 96, src_ptr + 96, _mm256_permute2x128_si256(v9, v13, 0x20));
+			xor_store_256(buf_ptr + 352, src_ptr + 352, _mm256_permute2x128_si256(v9, v13, 0x31));
+			xor_store_256(buf_ptr + 128, src_ptr + 128, _mm256_permute2x128_si256(v2, v6, 0x20));
+			xor_store_256(buf_ptr + 384, src_ptr + 384, _mm256_permute2x128_si256(v2, v6, 0x31));
+			xor_store_256(buf_ptr + 160, src_ptr + 160, _mm256_permute2x128_si256(v10, v14, 0x20));
+			xor_store_256(buf_ptr + 416, src_ptr + 416, _mm256_permute2x128_si256(v10, v14, 0x31));
+			xor_store_256(buf_ptr + 192, src_ptr + 192, _mm256_permute2x128_si256(v3, v7, 0x20));
+			xor_store_256(buf_ptr + 448, src_ptr + 448, _mm256_permute2x128_si256(v3, v7, 0x31));
+			xor_store_256(buf_ptr + 224, src_ptr + 224, _mm256_permute2x128_si256(v11, v15, 0x20));
+			xor_store_256(buf_ptr + 480, src_ptr + 480, _mm256_permute2x128_si256(v11, v15, 0x31));
+
+			key.data[12] += 8;
+		}
+
+		// Like transform_xor_8_blocks(), but every lane belongs to another of the batch_lanes states.
+		CHACHA_TARGET("avx2") static void keystream_8_states(const keypad_state& key, std::size_t rounds,
+			const std::uint32_t* tails, std::uint8_t* out)
+		{
+			const auto tail_ptr = reinterpret_cast<const __m256i*>(tails);
+
+			const auto k12 = _mm256_loadu_si256(tail_ptr + 0);
+			const auto k13 = _mm256_loadu_si256(tail_ptr + 1);
+			const auto k14 = _mm256_loadu_si256(tail_ptr + 2);
+			const auto k15 = _mm256_loadu_si256(tail_ptr + 3);
+
+			auto v0 = _mm256_set1_epi32(static_cast<int>(key.data[0]));
+			auto v1 = _mm256_set1_epi32(static_cast<int>(key.data[1]));
+			auto v2 = _mm256_set1_epi32(static_cast<int>(key.data[2]));
+			auto v3 = _mm256_set1_epi32(static_cast<int>(key.data[3]));
+			auto v4 = _mm256_set1_epi32(static_cast<int>(key.data[4]));
+			auto v5 = _mm256_set1_epi32(static_cast<int>(key.data[5]));
+			auto v6 = _mm256_set1_epi32(static_cast<int>(key.data[6]));
+			auto v7 = _mm256_set1_epi32(static_cast<int>(key.data[7]));
+			auto v8 = _mm256_set1_epi32(static_cast<int>(key.data[8]));
+			auto v9 = _mm256_set1_epi32(static_cast<int>(key.data[9]));
+			auto v10 = _mm256_set1_epi32(static_cast<int>(key.data[10]));
+			auto v11 = _mm256_set1_epi32(static_cast<int>(key.data[11]));
+			auto v12 = k12;
+			auto v13 = k13;
+			auto v14 = k14;
+			auto v15 = k15;
+
+			// assert(rounds % 2 == 0) // Gets enforced through higher level compile-time check.
+			for (std::size_t i = rounds / 2; i-- > 0; )
+			{
+				qround_256(v0, v4, v8, v12);
+				qround_256(v1, v5, v9, v13);
+				qround_256(v2, v6, v10, v14);
+				qround_256(v3, v7, v11, v15);
+
+				qround_256(v0, v5, v10, v15);
+				qround_256(v1, v6, v11, v12);
+				qround_256(v2, v7, v8, v13);
+				qround_256(v3, v4, v9, v14);
+			}
+
+			v0 = _mm256_add_epi32(v0, _mm256_set1_epi32(static_cast<int>(key.data[0])));
+			v1 = _mm256_add_epi32(v1, _mm256_set1_epi32(static_cast<int>(key.data[1])));
+			v2 = _mm256_add_epi32(v2, _mm256_set1_epi32(static_cast<int>(key.data[2])));
+			v3 = _mm256_add_epi32(v3, _mm256_set1_epi32(static_cast<int>(key.data[3])));
+			v4 = _mm256_add_epi32(v4, _mm256_set1_epi32(static_cast<int>(key.data[4])));
+			v5 = _mm256_add_epi32(v5, _mm256_set1_epi32(static_cast<int>(key.data[5])));
+			v6 = _mm256_add_epi32(v6, _mm256_set1_epi32(static_cast<int>(key.data[6])));
+			v7 = _mm256_add_epi32(v7, _mm256_set1_epi32(static_cast<int>(key.data[7])));
+			v8 = _mm256_add_epi32(v8, _mm256_set1_epi32(static_cast<int>(key.data[8])));
+			v9 = _mm256_add_epi32(v9, _mm256_set1_epi32(static_cast<int>(key.data[9])));
+			v10 = _mm256_add_epi32(v10, _mm256_set1_epi32(static_cast<int>(key.data[10])));
+			v11 = _mm256_add_epi32(v11, _mm256_set1_epi32(static_cast<int>(key.data[11])));
+			v12 = _mm256_add_epi32(v12, k12);
+			v13 = _mm256_add_epi32(v13, k13);
+			v14 = _mm256_add_epi32(v14, k14);
+			v15 = _mm256_add_epi32(v15, k15);
+
+			transpose_4x4_256(v0, v1, v2, v3);
+			transpose_4x4_256(v4, v5, v6, v7);
+			transpose_4x4_256(v8, v9, v10, v11);
+			transpose_4x4_256(v12, v13, v14, v15);
+
+			const auto buf_ptr = reinterpret_cast<__m256i*>(out);
+
+			_mm256_storeu_si256(buf_ptr + 0, _mm256_permute2x128_si256(v0, v4, 0x20));
+			_mm256_storeu_si256(buf_ptr + 8, _mm256_permute2x128_si256(v0, v4, 0x31));
+			_mm256_storeu_si256(buf_ptr + 1, _mm256_permute2x128_si256(v8, v12, 0x20));
+			_mm256_storeu_si256(buf_ptr + 9, _mm256_permute2x128_si256(v8, v12, 0x31));
+			_mm256_storeu_si256(buf_ptr + 2, _mm256_permute2x128_si256(v1, v5, 0x20));
+			_mm256_storeu_si256(buf_ptr + 10, _mm256_permute2x128_si256(v1, v5, 0x31));
+			_mm256_storeu_si256(buf_ptr + 3, _mm256_permute2x128_si256(v9, v13, 0x20));
+			_mm256_storeu_si256(buf_ptr + 11, _mm256_permute2x128_si256(v9, v13, 0x31));
+			_mm256_storeu_si256(buf_ptr + 4, _mm256_permute2x128_si256(v2, v6, 0x20));
+			_mm256_storeu_si256(buf_ptr + 12, _mm256_permute2x128_si256(v2, v6, 0x31));
+			_mm256_storeu_si256(buf_ptr + 5, _mm256_permute2x128_si256(v10, v14, 0x20));
+			_mm256_storeu_si256(buf_ptr + 13, _mm256_permute2x128_si256(v10, v14, 0x31));
+			_mm256_storeu_si256(buf_ptr + 6, _mm256_permute2x128_si256(v3, v7, 0x20));
+			_mm256_storeu_si256(buf_ptr + 14, _mm256_permute2x128_si256(v3, v7, 0x31));
+			_mm256_storeu_si256(buf_ptr + 7, _mm256_permute2x128_si256(v11, v15, 0x20));
+			_mm256_storeu_si256(buf_ptr + 15, _mm256_permute2x128_si256(v11, v15, 0x31));
+		}
+#endif
+
+#if defined(CHACHA_AVX512_AVAILABLE)
+		CHACHA_TARGET("avx512f") static void qround_512(__m512i& v0, __m512i& v1, __m512i& v2, __m512i& v3)
+		{
+			v0 = _mm512_add_epi32(v0, v1);
+			v3 = _mm512_rol_epi32(_mm512_xor_si512(v3, v0), 16);
+			v2 = _mm512_add_epi32(v2, v3);
+			v1 = _mm512_rol_epi32(_mm512_xor_si512(v1, v2), 12);
+			v0 = _mm512_add_epi32(v0, v1);
+			v3 = _mm512_rol_epi32(_mm512_xor_si512(v3, v0), 8);
+			v2 = _mm512_add_epi32(v2, v3);
+			v1 = _mm512_rol_epi32(_mm512_xor_si512(v1, v2), 7);
+		}
+
+		// Transposes the 4x4 matrices inside every 128-bit lane.
+		CHACHA_TARGET("avx512f") static void transpose_4x4_512(__m512i& v0, __m512i& v1, __m512i& v2, __m512i& v3)
+		{
+			const auto t0 = _mm512_unpacklo_epi32(v0, v1);
+			const auto t1 = _mm512_unpackhi_epi32(v0, v1);
+			const auto t2 = _mm512_unpacklo_epi32(v2, v3);
+			const auto t3 = _mm512_unpackhi_epi32(v2, v3);
+
+			v0 = _mm512_unpacklo_epi64(t0, t2);
+			v1 = _mm512_unpackhi_epi64(t0, t2);
+			v2 = _mm512_unpacklo_epi64(t1, t3);
+			v3 = _mm512_unpackhi_epi64(t1, t3);
+		}
+		// Transposes the 128-bit lanes of v0 to v3 and xors the resulting blocks 0, 4, 8 and 12
+		// (counted from buffer) with the source.
+		CHACHA_TARGET("avx512f") static void transpose_lanes_512(std::uint8_t* buffer, const std::uint8_t* source,
+			__m512i v0, __m512i v1, __m512i v2, __m512i v3)
+		{
+			const auto t0 = _mm512_shuffle_i32x4(v0, v1, 0x44);
+			const auto t1 = _mm512_shuffle_i32x4(v0, v1, 0xEE);
+			const auto t2 = _mm512_shuffle_i32x4(v2, v3, 0x44);
+			const auto t3 = _mm512_shuffle_i32x4(v2, v3, 0xEE);
+
+			_mm512_storeu_si512(buffer + 0, _mm512_xor_si512(
+				_mm512_shuffle_i32x4(t0, t2, 0x88), _mm512_loadu_si512(source + 0)));
+			_mm512_storeu_si512(buffer + 256, _mm512_xor_si512(
+				_mm512_shuffle_i32x4(t0, t2, 0xDD), _mm512_loadu_si512(source + 256)));
+			_mm512_storeu_si512(buffer + 512, _mm512_xor_si512(
+				_mm512_shuffle_i32x4(t1, t3, 0x88), _mm512_loadu_si512(source + 512)));
+			_mm512_storeu_si512(buffer + 768, _mm512_xor_si512(
+				_mm512_shuffle_i32x4(t1, t3, 0xDD), _mm512_loadu_si512(source + 768)));
+		}
+
+		CHACHA_TARGET("avx512f") static void transform_xor_16_blocks(
+			keypad_state& key, std::size_t rounds, void* buffer, const void* source)
+		{
+			const auto buf_ptr = static_cast<std::uint8_t*>(buffer);
+			const auto src_ptr = static_cast<const std::uint8_t*>(source);
+
+			// The counter only gets added to the lowest word, exactly like in transform_xor().
+			const auto counter = _mm512_add_epi32(
+				_mm512_set1_epi32(static_cast<int>(key.data[12])), _mm512_set_epi32(
+				15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0));
+
+			auto v0 = _mm512_set1_epi32(static_cast<int>(key.data[0]));
+			auto v1 = _mm512_set1_epi32(static_cast<int>(key.data[1]));
+			auto v2 = _mm512_set1_epi32(static_cast<int>(key.data[2]));
+			auto v3 = _mm512_set1_epi32(static_cast<int>(key.data[3]));
+			auto v4 = _mm512_set1_epi32(static_cast<int>(key.data[4]));
+			auto v5 = _mm512_set1_epi32(static_cast<int>(key.data[5]));
+			auto v6 = _mm512_set1_epi32(static_cast<int>(key.data[6]));
+			auto v7 = _mm512_set1_epi32(static_cast<int>(key.data[7]));
+			auto v8 = _mm512_set1_epi32(static_cast<int>(key.data[8]));
+			auto v9 = _mm512_set1_epi32(static_cast<int>(key.data[9]));
+			auto v10 = _mm512_set1_epi32(static_cast<int>(key.data[10]));
+			auto v11 = _mm512_set1_epi32(static_cast<int>(key.data[11]));
+			auto v12 = counter;
+			auto v13 = _mm512_set1_epi32(static_cast<int>(key.data[13]));
+			auto v14 = _mm512_set1_epi32(static_cast<int>(key.data[14]));
+			auto v15 = _mm512_set1_epi32(static_cast<int>(key.data[15]));
+
+			// assert(rounds % 2 == 0) // Gets enforced through higher level compile-time check.
+			for (std::size_t i = rounds / 2; i-- > 0; )
+			{
+				qround_512(v0, v4, v8, v12);
+				qround_512(v1, v5, v9, v13);
+				qround_512(v2, v6, v10, v14);
+				qround_512(v3, v7, v11, v15);
+
+				qround_512(v0, v5, v10, v15);
+				qround_512(v1, v6, v11, v12);
+				qround_512(v2, v7, v8, v13);
+				qround_512(v3, v4, v9, v14);
+			}
+
+			v0 = _mm512_add_epi32(v0, _mm512_set1_epi32(static_cast<int>(key.data[0])));
+			v1 = _mm512_add_epi32(v1, _mm512_set1_epi32(static_cast<int>(key.data[1])));
+			v2 = _mm512_add_epi32(v2, _mm512_set1_epi32(static_cast<int>(key.data[2])));
+			v3 = _mm512_add_epi32(v3, _mm512_set1_epi32(static_cast<int>(key.data[3])));
+			v4 = _mm512_add_epi32(v4, _mm512_set1_epi32(static_cast<int>(key.data[4])));
+			v5 = _mm512_add_epi32(v5, _mm512_set1_epi32(static_cast<int>(key.data[5])));
+			v6 = _mm512_add_epi32(v6, _mm512_set1_epi32(static_cast<int>(key.data[6])));
+			v7 = _mm512_add_epi32(v7, _mm512_set1_epi32(static_cast<int>(key.data[7])));
+			v8 = _mm512_add_epi32(v8, _mm512_set1_epi32(static_cast<int>(key.data[8])));
+			v9 = _mm512_add_epi32(v9, _mm512_set1_epi32(static_cast<int>(key.data[9])));
+			v10 = _mm512_add_epi32(v10, _mm512_set1_epi32(static_cast<int>(key.data[10])));
+			v11 = _mm512_add_epi32(v11, _mm512_set1_epi32(static_cast<int>(key.data[11])));
+			v12 = _mm512_add_epi32(v12, counter);
+			v13 = _mm512_add_epi32(v13, _mm512_set1_epi32(static_cast<int>(key.data[13])));
+			v14 = _mm512_add_epi32(v14, _mm512_set1_epi32(static_cast<int>(key.data[14])));
+			v15 = _mm512_add_epi32(v15, _mm512_set1_epi32(static_cast<int>(key.data[15])));
+
+			// Afterwards, lane l of v(4 * i + j) holds words 4 * i to 4 * i + 3
+			// of block 4 * l + j, so the 128-bit lanes need to be transposed as well.
+			transpose_4x4_512(v0, v1, v2, v3);
+			transpose_4x4_512(v4, v5, v6, v7);
+			transpose_4x4_512(v8, v9, v10, v11);
+			transpose_4x4_512(v12, v13, v14, v15);
+
+			transpose_lanes_512(buf_ptr + 0, src_ptr + 0, v0, v4, v8, v12);
+			transpose_lanes_512(buf_ptr + 64, src_ptr + 64, v1, v5, v9, v13);
+			transpose_lanes_512(buf_ptr + 128, src_ptr + 128, v2, v6, v10, v14);
+			transpose_lanes_512(buf_ptr + 192, src_ptr + 192, v3, v7, v11, v15);
+
+			key.data[12] += 16;
+		}
+#endif
+
+		// Processes as many bytes as possible with the widest kernel the CPU supports,
+		// returns the number of bytes processed. Always a multiple of 64.
+		static std::size_t transform_xor_wide(keypad_state& key, std::size_t rounds,
+			void* buffer, const void* source, std::size_t bytes)
+		{
+			const auto buf_ptr = static_cast<std::uint8_t*>(buffer);
+			const auto src_ptr = static_cast<const std::uint8_t*>(source);
+			std::size_t processed = 0;
+
+#if defined(CHACHA_AVX512_AVAILABLE)
+			if (cpu().avx512f)
+			{
+				for (; bytes - processed >= 1024; processed += 1024)
+				{
+					transform_xor_16_blocks(key, rounds, buf_ptr + processed, src_ptr + processed);
+				}
+			}
+#endif
+
+#if defined(CHACHA_AVX2_AVAILABLE)
+			if (cpu().avx2)
+			{
+				for (; bytes - processed >= 512; processed += 512)
+				{
+					transform_xor_8_blocks(key, rounds, buf_ptr + processed, src_ptr + processed);
+				}
+
+				for (; bytes - processed >= 256; processed += 256)
+				{
+					transform_xor_4_blocks(key, rounds, buf_ptr + processed, src_ptr + processed);
+				}
+			}
+#endif
+
+			static_cast<void>(buf_ptr);
+			static_cast<void>(src_ptr);
+
+			return processed;
+		}
+
+		// Computes the blocks of all batch_lanes states with the widest kernel the CPU supports.
+		static void keystream_batch(const keypad_state& key, std::size_t rounds,
+			const std::uint32_t* tails, std::uint8_t* out)
+		{
+#if defined(CHACHA_AVX2_AVAILABLE)
+			if (cpu().avx2)
+			{
+				keystream_8_states(key, rounds, tails, out);
+				return;
+			}
+#endif
+
+#if defined(CHACHA_SSE2_AVAILABLE)
+			keystream_4_states(key, rounds, tails, out);
+			keystream_4_states(key, rounds, tails + 4, out + 256);
+#else
+			keystream_batch_generic(key, rounds, tails, out);
+#endif
+		}
 	}
 }
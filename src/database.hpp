@@ -2,7 +2,13 @@
 
 #include "utility/property_node.hpp"
 #include "edit_distance.hpp"
+#include "entry_search.hpp"
 #include "memory_reader.hpp"
+#include "entry_index.hpp"
+#include "mapped_file.hpp"
+#include "safe_file.hpp"
+#include "secure_memory.hpp"
+#include "key_derivation.hpp"
 
 #include "chacha/chacha.hpp"
 #include "keccak/keccak.hpp"
@@ -13,11 +19,13 @@
 
 #include <algorithm>
 #include <array>
-#include <atomic>
+#include <deque>
+#include <functional>
 #include <memory>
 #include <random>
 #include <string>
 #include <stdexcept>
+#include <system_error>
 #include <thread>
 #include <vector>
 #include <sstream>
@@ -39,11 +47,38 @@
  * 32 byte enc_key = derive_key(password, nonce, "ENC-KEY");
  * 32 byte mac_key = derive_key(password, nonce, "MAC-KEY");
  * 
+ * Since 2.8 derive_key is deriveKeyMemoryHard() (see key_derivation.hpp) 
+ * with the parameters stored in the header, files below 2.8 use the function above.
+ * 
+ * Since 2.9 the expensive derivation only runs once:
+ * 32 byte file_key = deriveKeyMemoryHard(password, nonce, "FILE-KEY", params);
+ * 32 byte enc_key = shake256(file_key || "ENC-KEY");
+ * 32 byte mac_key = shake256(file_key || "MAC-KEY");
+ * 
+ * Since 2.10 every store also generates a save nonce, so file_key can be reused
+ * for several stores without reusing enc_key:
+ * 32 byte enc_key = shake256(file_key || save_nonce || "ENC-KEY");
+ * 32 byte mac_key = shake256(file_key || save_nonce || "MAC-KEY");
+ * 
+ * Since 2.11 hash and mac use tree_hash instead of sha3-256 (keccak::tree_hasher_256, 8 KiB leaves):
+ * tree_hash(m) = sha3-256(leaf_hash(leaf 0) || ... || leaf_hash(leaf n - 1) || uint64_t(size of m))
+ * 
+ * Since 2.12 the body is encrypted and authenticated in one pass by sponge_wrap (keccak::authenticated_encrypter_256)
+ * with key enc_key and header[16..128) as associated data, instead of chacha20 and a mac:
+ * the mac field holds mac_key as key check, the tag follows the save nonce
+ * and the hash only covers the header (the tag takes care of the body).
+ * 
  * 16 byte hash = truncate(sha3-256(everything after this)) (only for error detection)
  * 02 byte ffv (file format version, uint16_t)
- * 14 byte reserved (zeroed)
+ * 01 byte kdf id (0 = iterated sha3-256 (< 2.8), 1 = memory-hard)
+ * 01 byte kdf lanes
+ * 04 byte uint32_t kdf iterations
+ * 04 byte uint32_t kdf memory in KiB
+ * 04 byte reserved (zeroed)
  * 32 byte nonce = randomly generated on store
- * 32 byte mac = sha3-256(key || ffv + reserved-bytes after ffv || encrypted_data)
+ * 32 byte mac = sha3-256(key || ffv + kdf parameters + reserved-bytes after ffv || save_nonce + encrypted_data)
+ * 32 byte save nonce = randomly generated on every store (only since 2.10)
+ * 32 byte tag = sponge_wrap tag (only since 2.12)
  * ---- Encrypted ====
  * 08 byte int64_t timestamp (seconds since 1970)
  * 04 byte uint32_t number of database entries
@@ -87,30 +122,11 @@ static constexpr char asciiSpecial[] = "!\"#$%&'()*+,-./:;<=>?@[\\]^_`{|}~";
 typedef chacha::buffered_cipher Cipher;
 typedef keccak::random_engine_256 RandomGenerator;
 typedef keccak::sha3_256_hasher Hasher;
+typedef keccak::tree_hasher_256 TreeHasher;
+typedef keccak::authenticated_encrypter_256 BodyEncrypter;
+typedef keccak::authenticated_decrypter_256 BodyDecrypter;
 
-#if !defined(_MSC_VER) && !defined(__clang__)
-static_assert(false, "Make sure your compiler honors volatile here.");
-#endif
-
-inline void volatileZeroMemory(volatile void* ptr, std::size_t size)
-{
-	for (auto bytePtr = static_cast<volatile std::uint8_t*>(ptr); size-- > 0; ++bytePtr)
-	{
-		*bytePtr = 0;
-	}
-}
-
-inline void volatileTouchMemory(const volatile void* ptr, std::size_t size)
-{
-	std::uint8_t dummy;
-
-	for (auto bytePtr = static_cast<const volatile std::uint8_t*>(ptr); size-- > 0; ++bytePtr)
-	{
-		dummy = *bytePtr;
-	}
-}
-
-inline std::array<std::uint8_t, 32> deriveKey(const std::string& password,
+inline std::array<std::uint8_t, 32> deriveKey(const SecureString& password,
 	const std::array<std::uint8_t, 32>& nonce, const std::string& domain)
 {
 	Hasher hasher;
@@ -130,37 +146,72 @@ inline std::array<std::uint8_t, 32> deriveKey(const std::string& password,
 	return h;
 }
 
-inline void transformString(const std::array<std::uint8_t, 32>& key, std::string& str, 
-	std::uint64_t nonce, std::uint64_t startBlockIndex)
-{
-	chacha::unbuffered_cipher cipher(chacha::key_bits<256>(), key.data(), nonce);
-	cipher.set_block_index(startBlockIndex);
-	cipher.transform(&str[0], &str[0], str.size()); // str[0] is guaranteed to be valid!
-}
-
-class VolatileZeroGuard
+// Hash and mac of a file, sequential before 2.11 and a tree hash on all cores since.
+class FileHasher
 {
-	void* _ptr;
-	std::size_t _size;
+	Hasher _hasher;
+	TreeHasher _treeHasher;
+	bool _tree;
 
 public:
-	~VolatileZeroGuard()
+	explicit FileHasher(std::uint16_t minorVersion)
+		: _treeHasher(std::thread::hardware_concurrency())
+		, _tree(minorVersion >= 11)
+	{}
+
+	FileHasher(std::uint16_t minorVersion, const void* data, std::size_t size)
+		: FileHasher(minorVersion)
 	{
-		volatileZeroMemory(_ptr, _size);
+		update(data, size);
 	}
 
-	VolatileZeroGuard(void* ptr, std::size_t size)
-		: _ptr(ptr)
-		, _size(size)
-	{}
+	void update(const void* data, std::size_t size)
+	{
+		if (_tree)
+		{
+			_treeHasher.update(data, size);
+		}
+		else
+		{
+			_hasher.update(data, size);
+		}
+	}
+
+	void finish(void* buf, std::size_t size)
+	{
+		if (_tree)
+		{
+			_treeHasher.finish(buf, size);
+		}
+		else
+		{
+			_hasher.finish(buf, size);
+		}
+	}
+
+	std::array<std::uint8_t, 32> finish()
+	{
+		std::array<std::uint8_t, 32> hash;
+		finish(hash.data(), hash.size());
+		return hash;
+	}
 };
 
+template <typename String>
+inline void transformString(const std::array<std::uint8_t, 32>& key, String& str, 
+	std::uint64_t nonce, std::uint64_t startBlockIndex)
+{
+	chacha::unbuffered_cipher cipher(chacha::key_bits<256>(), key.data(), nonce);
+	cipher.set_block_index(startBlockIndex);
+	cipher.transform(&str[0], &str[0], str.size()); // str[0] is guaranteed to be valid!
+}
+
 class Snapshot
 {
 public:
 	std::time_t timestamp;
-	std::string username; // encrypted with temp key!
-	std::string password; // encrypted with temp key!
+	SecureString username; // encrypted with temp key!
+	SecureString password; // encrypted with temp key!
 
 	Snapshot() {}
 	Snapshot(const Snapshot&) = delete;
@@ -172,7 +223,7 @@ public:
 class PasswordGeneratorDesc
 {
 public:
-	std::string extraAlphabet;
+	SecureString extraAlphabet;
 	std::uint16_t passwordLength = 16;
 	bool genLetters = true;
 	bool genNumbers = true;
@@ -185,9 +236,9 @@ class LoginData
 public:
 	std::uint64_t uniqueId;
 	std::time_t timestamp;
-	std::string name;
-	std::string comment; // encrypted with temp key!
-	std::vector<Snapshot> snapshots;
+	SecureString name;
+	SecureString comment; // encrypted with temp key!
+	std::vector<Snapshot, SecureAllocator<Snapshot>> snapshots;
 	PasswordGeneratorDesc generatorDesc;
 	bool hide = false;
 };
@@ -211,7 +262,7 @@ inline std::string generateAlphabet(const PasswordGeneratorDesc& desc)
 	if (desc.genLetters) alphabet += asciiLetters;
 	if (desc.genNumbers) alphabet += asciiNumbers;
 	if (desc.genSpecial) alphabet += asciiSpecial;
-	if (desc.genExtra) alphabet += desc.extraAlphabet;
+	if (desc.genExtra) alphabet.append(desc.extraAlphabet.begin(), desc.extraAlphabet.end());
 
 	std::sort(alphabet.begin(), alphabet.end());
 	alphabet.erase(std::unique(alphabet.begin(), alphabet.end()), alphabet.end());
@@ -314,57 +365,63 @@ class LoginDatabase
 	};
 
 	static constexpr std::uint16_t FF_VER_MAJOR = 2;
-	static constexpr std::uint16_t FF_VER_MINOR = 7;
+	static constexpr std::uint16_t FF_VER_MINOR = 12;
 	static constexpr std::uint16_t FF_VER = FF_VER_MAJOR << 8 | FF_VER_MINOR;
 
-	std::array<std::uint8_t, 32> _tempKey;
-	RandomGenerator _randomGenerator;
-	std::string _password; // encrypted with temp key!
-	std::vector<LoginData> _database;
-	std::time_t _lastSerialize;
-	std::thread _swapPreventionThread;
-	std::atomic_bool _stopThread = false;
+	static constexpr std::uint8_t KDF_ITERATED_SHA3 = 0;
+	static constexpr std::uint8_t KDF_MEMORY_HARD = 1;
 
-public:
-	~LoginDatabase()
+	// Everything secret the database keeps besides its entries.
+	struct Secrets
 	{
-		_stopThread = true;
-		_swapPreventionThread.join();
-		volatileZeroMemory(&_tempKey, sizeof _tempKey);
-		volatileZeroMemory(&_randomGenerator, sizeof _randomGenerator);
-	}
+		std::array<std::uint8_t, 32> tempKey;
+		RandomGenerator randomGenerator;
+		SecureString password; // encrypted with temp key!
+		std::array<std::uint8_t, 32> cachedFileKey; // encrypted with temp key!
+
+		Secrets()
+			: randomGenerator(nullptr, 0)
+		{}
+	};
 
+	SecurePtr<Secrets> _secrets; // On locked pages, which keeps them out of the page file
+	std::deque<LoginData, SecureAllocator<LoginData>> _database; // Entries never move once added, their search state is kept by _search
+	EntryIndex _index; // uniqueId -> position in _database
+	EntrySearch _search;
+	std::time_t _lastSerialize;
+	std::size_t _parallelCipherThreshold = 1024 * 1024;
+	std::uint64_t _mappedLoadThreshold = 8 * 1024 * 1024;
+	KdfParameters _kdfParameters = { 2, 64 * 1024, 4 };
+	std::uint16_t _saveMinorVersion = FF_VER_MINOR;
+	bool _cacheFileKey = false;
+	bool _fileKeyCached = false;
+	std::array<std::uint8_t, 32> _cachedFileKeyNonce;
+	KdfParameters _cachedKdfParameters;
+
+public:
 	LoginDatabase(LoginDatabase&&) = delete; // Prevents auto generation of move/copy operators.
 
-	LoginDatabase(std::string password)
-		: _password(std::move(password))
-		, _randomGenerator(nullptr, 0)
+	LoginDatabase(const SecureString& password)
+		: _secrets(makeSecure<Secrets>())
 	{
+		_secrets->password = password;
+
 		auto s0 = std::time(nullptr);
 		auto s1 = std::chrono::steady_clock::now();
 		auto s2 = std::random_device()();
 		auto s3 = std::random_device()();
 
-		_randomGenerator.reseed(&s0, sizeof s0);
-		_randomGenerator.reseed(&s1, sizeof s1);
-		_randomGenerator.reseed(&s2, sizeof s2);
-		_randomGenerator.reseed(&s3, sizeof s3);
+		_secrets->randomGenerator.reseed(&s0, sizeof s0);
+		_secrets->randomGenerator.reseed(&s1, sizeof s1);
+		_secrets->randomGenerator.reseed(&s2, sizeof s2);
+		_secrets->randomGenerator.reseed(&s3, sizeof s3);
 
 		std::array<std::uint8_t, 32> tempKeyNonce;
-		_randomGenerator.extract(&tempKeyNonce[0], 32);
-
-		_tempKey = deriveKey(_password, tempKeyNonce, "TMP-KEY");
+		_secrets->randomGenerator.extract(&tempKeyNonce[0], 32);
 
-		transformString(_tempKey, _password, 0, 0);
+		_secrets->tempKey = deriveKey(_secrets->password, tempKeyNonce, "TMP-KEY");
 
-		_swapPreventionThread = std::thread([this] {
-			while (!this->_stopThread)
-			{
-				volatileTouchMemory(&this->_tempKey, sizeof this->_tempKey);
-				volatileTouchMemory(&this->_randomGenerator, sizeof this->_randomGenerator);
-				std::this_thread::sleep_for(std::chrono::milliseconds(80));
-			}
-		});
+		transformString(_secrets->tempKey, _secrets->password, 0, 0);
 	}
 
 	std::size_t countSnapshots() const
@@ -385,15 +442,16 @@ public:
 	std::uint64_t makeUniqueId()
 	{
 		std::uint64_t uniqueId;
-		_randomGenerator.extract(&uniqueId, sizeof uniqueId);
+		_secrets->randomGenerator.extract(&uniqueId, sizeof uniqueId);
 		return uniqueId;
 	}
 
+	// Entries in the order of the last sort(), entries added since follow in the order they were added.
 	LoginData* getEntry(std::size_t index)
 	{
 		if (index < _database.size())
 		{
-			return &_database[index];
+			return &_database[_search.position(index)];
 		}
 
 		return nullptr;
@@ -401,19 +459,14 @@ public:
 
 	LoginData* findEntry(std::uint64_t uniqueId)
 	{
-		for (auto& entry : _database)
-		{
-			if (entry.uniqueId == uniqueId)
-			{
-				return &entry;
-			}
-		}
-
-		return nullptr;
+		const auto slot = _index.find(uniqueId);
+		return slot == EntryIndex::npos ? nullptr : &_database[slot];
 	}
 
 	LoginData* pushEntry(LoginData&& data)
 	{
+		// With duplicate ids the first entry wins, just like a linear search would.
+		_index.insert(data.uniqueId, _database.size());
 		_database.push_back(std::move(data));
 		return &_database.back();
 	}
@@ -425,112 +478,618 @@ public:
 
 	void transformEntry(LoginData& data)
 	{
-		transformString(_tempKey, data.comment, data.uniqueId, 0);
+		transformEntries(&data, &data + 1);
+	}
+
+	// Same as transformEntry() for every entry, but computes the key stream for all of them in one batch.
+	template <typename Iterator>
+	void transformEntries(Iterator begin, Iterator end)
+	{
+		std::vector<chacha::transform_span> spans;
+
+		const auto addSpan = [&](SecureString& str, std::uint64_t nonce, std::uint64_t startBlockIndex)
+		{
+			if (!str.empty())
+			{
+				spans.push_back({ nonce, startBlockIndex, &str[0], str.size() });
+			}
+		};
+
+		for (auto it = begin; it != end; ++it)
+		{
+			auto& data = *it;
+			addSpan(data.comment, data.uniqueId, 0);
+
+			for (std::size_t i = 0; i < data.snapshots.size(); ++i)
+			{
+				addSpan(data.snapshots[i].username, data.uniqueId, usernameBlockIndex(i));
+				addSpan(data.snapshots[i].password, data.uniqueId, passwordBlockIndex(i));
+			}
+		}
+
+		chacha::batch_transform(chacha::key_bits<256>(), _secrets->tempKey.data(), spans.data(), spans.size());
+	}
+
+	// File bodies of at least this many bytes get encrypted/decrypted on all cores.
+	void setParallelCipherThreshold(std::size_t bytes)
+	{
+		_parallelCipherThreshold = bytes;
+	}
+
+	// Files of at least this many bytes are memory mapped when loading instead of streamed.
+	void setMappedLoadThreshold(std::uint64_t bytes)
+	{
+		_mappedLoadThreshold = bytes;
+	}
+
+	// Parameters used for the key derivation when saving. (Loading uses the ones stored in the file.)
+	void setKdfParameters(const KdfParameters& params)
+	{
+		if (!validKdfParameters(params))
+		{
+			throw std::invalid_argument("Invalid key derivation parameters.");
+		}
+
+		_kdfParameters = params;
+	}
+
+	// Minor file format version used when saving, 0 selects the newest. A file saved as 2.x only
+	// opens in builds that read 2.x, so 10 and 11 still help builds from before 2.11 and 2.12, but not
+	// the releases that stop at 2.7. Unlike 12, they encrypt and mac the body on all cores.
+	void setSaveFormatVersion(std::uint16_t minorVersion)
+	{
+		if (minorVersion == 0)
+		{
+			minorVersion = FF_VER_MINOR;
+		}
+
+		if (minorVersion < 10 || minorVersion > FF_VER_MINOR)
+		{
+			throw std::invalid_argument("Unsupported file format version.");
+		}
+
+		_saveMinorVersion = minorVersion;
+	}
+
+	// Keeps the last file key around, so following stores don't need to run the key derivation.
+	void setFileKeyCaching(bool enable)
+	{
+		_cacheFileKey = enable;
 
-		for (std::size_t i = 0; i < data.snapshots.size(); ++i)
+		if (!enable)
 		{
-			transformString(_tempKey, data.snapshots[i].username, data.uniqueId, (i + 1) * 0xFFFF);
-			transformString(_tempKey, data.snapshots[i].password, data.uniqueId, (i + 1) * 0xFFFFFF);
+			clearFileKeyCache();
 		}
 	}
 
+	void clearFileKeyCache()
+	{
+		_fileKeyCached = false;
+		volatileZeroMemory(&_secrets->cachedFileKey, sizeof _secrets->cachedFileKey);
+	}
+
+	void transformCachedFileKey()
+	{ // Block index is far beyond anything the password could reach.
+		chacha::unbuffered_cipher cipher(chacha::key_bits<256>(), _secrets->tempKey.data(), 0);
+		cipher.set_block_index(std::uint64_t{ 1 } << 32);
+		cipher.transform(_secrets->cachedFileKey.data(), _secrets->cachedFileKey.data(), _secrets->cachedFileKey.size());
+	}
+
+	bool fileKeyCachedFor(const std::array<std::uint8_t, 32>& nonce, const KdfParameters& params) const
+	{
+		return _fileKeyCached
+			&& _cachedFileKeyNonce == nonce
+			&& _cachedKdfParameters.iterations == params.iterations
+			&& _cachedKdfParameters.memoryKiB == params.memoryKiB
+			&& _cachedKdfParameters.lanes == params.lanes;
+	}
+
 	void reseedRng(const void* data, std::size_t size)
 	{
-		_randomGenerator.reseed(data, size);
+		_secrets->randomGenerator.reseed(data, size);
 	}
 
 	std::string generatePassword(const PasswordGeneratorDesc& desc)
 	{
-		return ::generatePassword(desc, _randomGenerator);
+		return ::generatePassword(desc, _secrets->randomGenerator);
 	}
 
-	void sort(const std::string& searchString)
+	// Window used for streaming file bodies, a multiple of 192 bytes (3 cipher blocks).
+	// Large enough for transformFileBody() to go parallel on big files.
+	std::size_t streamChunkSize() const
+	{
+		constexpr std::size_t minChunkSize = 192 * 1024;
+		constexpr std::size_t maxChunkSize = 16 * 1024 * 1024;
+
+		if (_parallelCipherThreshold > maxChunkSize)
+		{
+			return minChunkSize;
+		}
+
+		return (std::max(minChunkSize, _parallelCipherThreshold) + 191) / 192 * 192;
+	}
+
+	void transformFileBody(const std::array<std::uint8_t, 32>& key, std::uint8_t* buffer,
+		const std::uint8_t* source, std::size_t size, std::uint64_t startBlockIndex)
 	{
-		std::sort(_database.begin(), _database.end(),
-			[&](const LoginData& lhs, const LoginData& rhs) {
+		if (size >= _parallelCipherThreshold)
+		{
+			chacha::parallel_transform(chacha::key_bits<256>(), key.data(), 0, startBlockIndex, 
+				buffer, source, size, std::thread::hardware_concurrency());
+		}
+		else
+		{
+			Cipher cipher(chacha::key_bits<256>(), key.data(), 0);
+			cipher.set_block_index(startBlockIndex);
+			cipher.transform(buffer, source, size);
+			volatileZeroMemory(&cipher, sizeof cipher);
+		}
+	}
 
-			// Hidden entries always have lower priority.
-			if (lhs.hide != rhs.hide)
-				return rhs.hide;
+	// Only the first fileHeaderSize(_saveMinorVersion) bytes are used.
+	std::array<std::uint8_t, 160> makeFileHeader()
+	{
+		std::array<std::uint8_t, 160> header = {};
+
+		const auto fileFormatVersion = static_cast<std::uint16_t>(FF_VER_MAJOR << 8 | _saveMinorVersion);
+		std::memcpy(&header[16], &fileFormatVersion, sizeof fileFormatVersion);
+		header[18] = KDF_MEMORY_HARD;
+		header[19] = _kdfParameters.lanes;
+		std::memcpy(&header[20], &_kdfParameters.iterations, sizeof _kdfParameters.iterations);
+		std::memcpy(&header[24], &_kdfParameters.memoryKiB, sizeof _kdfParameters.memoryKiB);
+
+		if (fileKeyCachedFor(_cachedFileKeyNonce, _kdfParameters))
+		{ // Reusing the nonce lets deriveFileKeys() take the cached file key.
+			std::memcpy(&header[32], &_cachedFileKeyNonce[0], 32);
+		}
+		else
+		{
+			_secrets->randomGenerator.extract(&header[32], 32); // Generating nonce
+		}
 
-			// Calculate distances to search string
-			auto ldistance = wordBasedEditDistance(searchString, lhs.name);
-			auto rdistance = wordBasedEditDistance(searchString, rhs.name);
+		_secrets->randomGenerator.extract(&header[96], 32); // Generating save nonce
 
-			if (ldistance != rdistance)
-				return ldistance < rdistance;
+		return header;
+	}
 
-			// If strings have the same distance, sort lexicographically
-			return lhs.name < rhs.name;
-		});
+	// Where the temp key stream of a snapshot's strings starts, the comment starts at 0.
+	static std::uint64_t usernameBlockIndex(std::size_t snapshot)
+	{
+		return (snapshot + 1) * 0xFFFF;
 	}
 
-	void mergeFromEncryptedFile(const std::string& filename)
+	static std::uint64_t passwordBlockIndex(std::size_t snapshot)
 	{
-		auto aaa = readFileBinary(filename);
-		std::vector<std::uint8_t> buffer(aaa.size());
-		std::memcpy(buffer.data(), aaa.data(), buffer.size());
+		return (snapshot + 1) * 0xFFFFFF;
+	}
 
-		VolatileZeroGuard bufferZeroGuard(buffer.data(), buffer.size());
+	// Exact size of what writeEncryptedBody() produces.
+	std::uint64_t serializedBodySize() const
+	{
+		const auto stringSize = [](const SecureString& s)
+		{
+			return sizeof(std::uint16_t) + std::min(std::size_t{ 0xFFFF }, s.size());
+		};
 
-		if (buffer.size() < 128)
+		std::uint64_t size = 8 + 4 + 20;
+
+		for (auto& entry : _database)
 		{
-			throw std::runtime_error("Database file too small.");
+			size += 8 + 8 + 2;
+
+			for (auto& snapshot : entry.snapshots)
+			{
+				size += 8 + stringSize(snapshot.username) + stringSize(snapshot.password);
+			}
+
+			size += stringSize(entry.name) + stringSize(entry.comment) + stringSize(entry.generatorDesc.extraAlphabet);
+			size += 2 + 2;
 		}
 
-		std::array<std::uint8_t, 16> givenHash;
-		std::memcpy(&givenHash[0], &buffer[0], 16);
-		std::array<std::uint8_t, 16> actualHash;
-		Hasher(&buffer[16], buffer.size() - 16).finish(&actualHash[0], 16);
+		return size;
+	}
 
-		if (givenHash != actualHash)
+	void checkSerializable() const
+	{
+		for (auto& entry : _database)
 		{
-			throw std::runtime_error("File was damaged.");
+			if (entry.snapshots.size() > 0xFFFF)
+			{ // This will *never* happen in normal usage. (Nobody changes the password for a service over 65,000 times.)
+				throw std::invalid_argument("Too many snapshots in database entry."
+					" Please use text export and manually erase them.");
+			}
 		}
+	}
 
-		std::uint16_t fileFormatVersion;
-		std::memcpy(&fileFormatVersion, &buffer[16], sizeof fileFormatVersion);
+	// Calls process(offset, size) for slices of a file body range that stay in cache while cipher,
+	// mac and hash run over them one after another. With several cores, ranges big enough
+	// for the parallel cipher are passed on whole instead, every stage then runs on all cores.
+	template <typename Process>
+	void forEachSlice(std::size_t size, Process&& process) const
+	{
+		constexpr std::size_t sliceSize = 96 * 1024; // Multiple of 192, fits into L2 with room to spare.
 
-		if (fileFormatVersion >> 8 != FF_VER_MAJOR)
+		if (size >= _parallelCipherThreshold && std::thread::hardware_concurrency() > 1)
 		{
-			throw std::runtime_error("Incompatible file format version.");
+			process(std::size_t{ 0 }, size);
+			return;
+		}
+
+		for (std::size_t offset = 0; offset < size; offset += sliceSize)
+		{
+			process(offset, std::min(sliceSize, size - offset));
+		}
+	}
+
+	// Serializes, encrypts and macs the file body chunk by chunk, sink(data, size) receives the encrypted chunks.
+	// Fills in the mac (or key check and tag) of header, which needs everything but the hash already set.
+	// Also fills in the hash, except for 2.10, where it has to run over the finished file.
+	template <typename Sink>
+	void writeEncryptedBody(std::uint8_t* header, const std::array<std::uint8_t, 32>& enckey,
+		const std::array<std::uint8_t, 32>& mackey, Sink&& sink)
+	{
+		_lastSerialize = std::time(nullptr);
+
+		const auto nEntries = static_cast<std::uint32_t>(std::min(std::size_t{ 0xFFFFFFFF }, _database.size()));
+		const std::array<std::uint8_t, 20> reserved = {};
+		const auto headerSize = fileHeaderSize(_saveMinorVersion);
+		const bool wrapped = _saveMinorVersion >= 12;
+		const bool hashAlong = _saveMinorVersion == 11;
+
+		FileHasher macHasher(_saveMinorVersion, mackey.data(), mackey.size());
+		macHasher.update(&header[16], 16);
+		macHasher.update(&header[96], 32);
+
+		// The hash covers the mac, only the first leaf of the tree hash has to wait for it.
+		TreeHasher hasher(std::thread::hardware_concurrency());
+		std::vector<std::uint8_t> firstLeaf(TreeHasher::leaf_size);
+		std::size_t firstLeafUsed = headerSize - 16;
+
+		if (hashAlong)
+		{
+			hasher.defer_first_leaf();
+		}
+
+		BodyEncrypter encrypter(enckey.data(), enckey.size());
+
+		if (wrapped)
+		{
+			std::memcpy(&header[64], mackey.data(), mackey.size());
+			encrypter.begin(&header[16], 112);
+		}
+
+		std::vector<std::uint8_t, SecureAllocator<std::uint8_t>> chunk(streamChunkSize());
+		std::size_t chunkUsed = 0;
+		std::uint64_t blockIndex = 0;
+
+		const auto flushChunk = [&]()
+		{
+			if (wrapped)
+			{
+				encrypter.transform(chunk.data(), chunk.data(), chunkUsed);
+			}
+			else
+			{
+				forEachSlice(chunkUsed, [&](std::size_t offset, std::size_t size)
+				{
+					const auto slice = &chunk[offset];
+					transformFileBody(enckey, slice, slice, size, blockIndex);
+					macHasher.update(slice, size);
+					blockIndex += size / 64;
+
+					if (hashAlong)
+					{
+						const auto n = std::min(size, firstLeaf.size() - firstLeafUsed);
+						std::memcpy(&firstLeaf[firstLeafUsed], slice, n);
+						firstLeafUsed += n;
+						hasher.update(slice + n, size - n);
+					}
+				});
+			}
+
+			sink(chunk.data(), chunkUsed);
+			chunkUsed = 0;
+		};
+
+		// Moves size bytes from data into the chunks with copy(dest, source, n).
+		const auto writeWith = [&](const void* data, std::size_t size, auto&& copy)
+		{
+			auto bytePtr = static_cast<const std::uint8_t*>(data);
+
+			while (size > 0)
+			{
+				const auto n = std::min(size, chunk.size() - chunkUsed);
+				copy(&chunk[chunkUsed], bytePtr, n);
+				chunkUsed += n;
+				bytePtr += n;
+				size -= n;
+
+				if (chunkUsed == chunk.size())
+				{
+					flushChunk();
+				}
+			}
+		};
+
+		const auto writeToBuffer = [&](const void* data, std::size_t size)
+		{
+			writeWith(data, size, [](std::uint8_t* dest, const std::uint8_t* source, std::size_t n)
+			{
+				std::memcpy(dest, source, n);
+			});
+		};
+
+		const auto writeString = [&](const SecureString& s)
+		{
+			const auto size = static_cast<std::uint16_t>(std::min(std::size_t{ 0xFFFF }, s.size()));
+			writeToBuffer(&size, sizeof size);
+			writeToBuffer(s.data(), size);
+		};
+
+		// Strings encrypted with the temp key get decrypted on their way into the chunk instead of in place.
+		const auto writeSecretString = [&](const SecureString& s, std::uint64_t nonce, std::uint64_t startBlockIndex)
+		{
+			const auto size = static_cast<std::uint16_t>(std::min(std::size_t{ 0xFFFF }, s.size()));
+			writeToBuffer(&size, sizeof size);
+
+			// The key stream has to match transformString(), so every piece sets its own block
+			// index and a block that straddles two chunks gets its key stream computed on its own.
+			chacha::unbuffered_cipher cipher(chacha::key_bits<256>(), _secrets->tempKey.data(), nonce);
+			alignas(16) std::array<std::uint8_t, 64> block;
+			std::size_t offset = 0;
+
+			writeWith(s.data(), size, [&](std::uint8_t* dest, const std::uint8_t* source, std::size_t n)
+			{
+				std::size_t done = 0;
+
+				if (offset % 64 != 0)
+				{
+					block.fill(0);
+					cipher.set_block_index(startBlockIndex + offset / 64);
+					cipher.transform(block.data(), block.data(), block.size());
+					done = std::min(n, 64 - offset % 64);
+
+					for (std::size_t i = 0; i < done; ++i)
+					{
+						dest[i] = source[i] ^ block[offset % 64 + i];
+					}
+				}
+
+				if (done < n)
+				{
+					cipher.set_block_index(startBlockIndex + (offset + done) / 64);
+					cipher.transform(dest + done, source + done, n - done);
+				}
+
+				offset += n;
+			});
+
+			volatileZeroMemory(&block, sizeof block);
+			volatileZeroMemory(&cipher, sizeof cipher);
+		};
+
+		writeToBuffer(&_lastSerialize, sizeof _lastSerialize);
+		writeToBuffer(&nEntries, sizeof nEntries);
+		writeToBuffer(&reserved[0], reserved.size());
+
+		for (auto& entry : _database)
+		{
+			const auto nSnapshots = static_cast<std::uint16_t>(entry.snapshots.size());
+			writeToBuffer(&entry.uniqueId, sizeof entry.uniqueId);
+			writeToBuffer(&entry.timestamp, sizeof entry.timestamp);
+			writeToBuffer(&nSnapshots, sizeof nSnapshots);
+
+			for (std::size_t i = 0; i < nSnapshots; ++i)
+			{
+				auto& snapshot = entry.snapshots[i];
+				writeToBuffer(&snapshot.timestamp, sizeof snapshot.timestamp);
+				writeSecretString(snapshot.username, entry.uniqueId, usernameBlockIndex(i));
+				writeSecretString(snapshot.password, entry.uniqueId, passwordBlockIndex(i));
+			}
+
+			writeString(entry.name);
+			writeSecretString(entry.comment, entry.uniqueId, 0);
+			writeString(entry.generatorDesc.extraAlphabet);
+
+			std::uint16_t flags = 0;
+			flags |= (entry.generatorDesc.genLetters << 0u);
+			flags |= (entry.generatorDesc.genNumbers << 1u);
+			flags |= (entry.generatorDesc.genSpecial << 2u);
+			flags |= (entry.generatorDesc.genExtra << 3u);
+			flags |= (entry.hide << 4u);
+
+			writeToBuffer(&entry.generatorDesc.passwordLength, sizeof entry.generatorDesc.passwordLength);
+			writeToBuffer(&flags, sizeof flags);
+		}
+
+		if (chunkUsed > 0)
+		{
+			flushChunk();
+		}
+
+		if (wrapped)
+		{
+			encrypter.finish(&header[128], 32);
+			FileHasher(_saveMinorVersion, &header[16], headerSize - 16).finish(&header[0], 16);
+		}
+		else
+		{
+			macHasher.finish(&header[64], 32);
 		}
 
+		if (hashAlong)
+		{
+			std::memcpy(&firstLeaf[0], &header[16], headerSize - 16);
+			hasher.finish_first_leaf(firstLeaf.data(), firstLeafUsed);
+			hasher.finish(&header[0], 16);
+		}
+
+		volatileZeroMemory(&encrypter, sizeof encrypter);
+	}
+
+	void deriveFileKeys(const std::uint8_t* header,
+		std::array<std::uint8_t, 32>& enckey, std::array<std::uint8_t, 32>& mackey)
+	{
+		std::uint16_t fileFormatVersion;
+		std::memcpy(&fileFormatVersion, &header[16], sizeof fileFormatVersion);
+
 		std::array<std::uint8_t, 32> nonce;
-		std::memcpy(&nonce[0], &buffer[32], 32);
-		transformString(_tempKey, _password, 0, 0);
-		auto enckey = deriveKey(_password, nonce, "ENC-KEY");
-		auto mackey = deriveKey(_password, nonce, "MAC-KEY");
-		transformString(_tempKey, _password, 0, 0);
-		VolatileZeroGuard keyZeroGuard(&enckey, sizeof enckey);
-		VolatileZeroGuard macZeroGuard(&mackey, sizeof mackey);
+		std::memcpy(&nonce[0], &header[32], 32);
 
-		Hasher hasher(mackey.data(), mackey.size());
-		hasher.update(&buffer[16], 16);
-		hasher.update(&buffer[96], buffer.size() - 96);
+		KdfParameters params;
+		params.lanes = header[19];
+		std::memcpy(&params.iterations, &header[20], sizeof params.iterations);
+		std::memcpy(&params.memoryKiB, &header[24], sizeof params.memoryKiB);
 
-		auto calculatedMac = hasher.finish();
+		const auto minorVersion = fileFormatVersion & 0xFF;
+		const bool legacyKdf = minorVersion < 8;
 
-		// No need to worry about timing attacks, correct MAC is obviously known to anyone.
-		if (std::memcmp(&calculatedMac[0], &buffer[64], 32) != 0)
+		if (!legacyKdf && header[18] != KDF_MEMORY_HARD)
 		{
-			throw std::runtime_error("Wrong password.");
+			throw std::runtime_error("Unknown key derivation function.");
 		}
 
-		Cipher cipher(chacha::key_bits<256>(), enckey.data(), 0);
-		cipher.transform(&buffer[96], &buffer[96], buffer.size() - 96);
-		volatileZeroMemory(&cipher, sizeof cipher);
+		if (!legacyKdf && !validKdfParameters(params))
+		{
+			throw std::runtime_error("Invalid key derivation parameters in file.");
+		}
 
-		std::uint32_t nEntries;
+		transformString(_secrets->tempKey, _secrets->password, 0, 0);
+
+		try
+		{
+			if (legacyKdf)
+			{ // The two passes are independent, run them side by side.
+				const auto deriveMacKey = [&] { mackey = deriveKey(_secrets->password, nonce, "MAC-KEY"); };
+				std::thread macThread;
+
+				try
+				{
+					macThread = std::thread(deriveMacKey);
+				}
+				catch (std::system_error&)
+				{
+					deriveMacKey();
+				}
+
+				enckey = deriveKey(_secrets->password, nonce, "ENC-KEY");
+
+				if (macThread.joinable())
+				{
+					macThread.join();
+				}
+			}
+			else if (minorVersion < 9)
+			{
+				enckey = deriveKeyMemoryHard(_secrets->password, nonce, "ENC-KEY", params);
+				mackey = deriveKeyMemoryHard(_secrets->password, nonce, "MAC-KEY", params);
+			}
+			else
+			{
+				std::array<std::uint8_t, 32> fileKey;
+				VolatileZeroGuard fileKeyZeroGuard(&fileKey, sizeof fileKey);
+
+				if (fileKeyCachedFor(nonce, params))
+				{
+					transformCachedFileKey();
+					fileKey = _secrets->cachedFileKey;
+					transformCachedFileKey();
+				}
+				else
+				{
+					fileKey = deriveKeyMemoryHard(_secrets->password, nonce, "FILE-KEY", params);
+				}
+
+				if (_cacheFileKey)
+				{
+					_secrets->cachedFileKey = fileKey;
+					_cachedFileKeyNonce = nonce;
+					_cachedKdfParameters = params;
+					_fileKeyCached = true;
+					transformCachedFileKey();
+				}
+
+				const auto subkeys = minorVersion < 10
+					? expandKeys<2>(fileKey, { "ENC-KEY", "MAC-KEY" })
+					: expandKeys<2>(fileKey, { "ENC-KEY", "MAC-KEY" }, &header[96], 32);
+
+				enckey = subkeys[0];
+				mackey = subkeys[1];
+			}
+		}
+		catch (...)
+		{
+			transformString(_secrets->tempKey, _secrets->password, 0, 0);
+			throw;
+		}
+
+		transformString(_secrets->tempKey, _secrets->password, 0, 0);
+	}
 
-		std::memcpy(&_lastSerialize, &buffer[96], sizeof _lastSerialize);
-		std::memcpy(&nEntries, &buffer[104], sizeof nEntries);
+	// Ranks the entries by their distance to searchString, see getEntry(). The entries themselves don't move.
+	void sort(const std::string& searchString)
+	{
+		_search.run(searchString, _database);
+	}
+
+	// Like sort(), but returns right away. onFinished is called (possibly from another thread)
+	// when finishSort() will take the result. Starting another search cancels this one.
+	void startSort(const std::string& searchString, std::function<void()> onFinished)
+	{
+		_search.start(searchString, _database, std::move(onFinished));
+	}
+
+	// Returns true if the ranking changed.
+	bool finishSort()
+	{
+		return _search.finish();
+	}
+
+	// Returns the minor version. Runs before the hash is checked, which depends on it.
+	static std::uint16_t checkFileFormatVersion(const std::uint8_t* header)
+	{
+		std::uint16_t fileFormatVersion;
+		std::memcpy(&fileFormatVersion, &header[16], sizeof fileFormatVersion);
+
+		if (fileFormatVersion >> 8 != FF_VER_MAJOR)
+		{
+			throw std::runtime_error("Incompatible file format version.");
+		}
+
+		if ((fileFormatVersion & 0xFF) > FF_VER_MINOR)
+		{
+			throw std::runtime_error("File was created by a newer version of this program.");
+		}
+
+		return fileFormatVersion & 0xFF;
+	}
+
+	// Offset of the encrypted body. (Since 2.10 the save nonce and since 2.12 the tag sit between mac and body.)
+	static std::size_t fileHeaderSize(std::uint16_t minorVersion)
+	{
+		return minorVersion < 10 ? 96 : minorVersion < 12 ? 128 : 160;
+	}
+
+	// Returns the offset of the encrypted body.
+	static std::size_t checkFileHeader(const std::uint8_t* header, std::uint64_t fileSize)
+	{
+		const std::size_t bodyOffset = fileHeaderSize(checkFileFormatVersion(header));
+
+		if (fileSize < bodyOffset + 32)
+		{
+			throw std::runtime_error("Database file too small.");
+		}
 
-		MemoryReader memoryReader(buffer.data() + 128, buffer.size() - 128);
+		return bodyOffset;
+	}
 
+	// Parses the decrypted file body, reader needs bool read(void* buffer, std::size_t size).
+	template <typename Reader>
+	void parseFileBody(Reader& reader, std::time_t& lastSerialize, std::vector<LoginData, SecureAllocator<LoginData>>& entries)
+	{
 		const auto extractData = [&](void* buffer, std::size_t size)
 		{
-			if (!memoryReader.read(buffer, size))
+			if (!reader.read(buffer, size))
 			{
 				throw std::runtime_error("Unexpected end of file while parsing database.");
 			}
@@ -540,11 +1099,18 @@ public:
 		{
 			std::uint16_t size;
 			extractData(&size, sizeof size);
-			std::string str(size, char());
+			SecureString str(size, char());
 			extractData(&str[0], size); // &s[0] is always valid.
 			return str;
 		};
 
+		std::uint32_t nEntries;
+		std::array<std::uint8_t, 20> reserved;
+
+		extractData(&lastSerialize, sizeof lastSerialize);
+		extractData(&nEntries, sizeof nEntries);
+		extractData(&reserved[0], reserved.size());
+
 		while (nEntries--)
 		{
 			LoginData loginData;
@@ -579,102 +1145,384 @@ public:
 			loginData.generatorDesc.genExtra = (flags & 0x8) != 0;
 			loginData.hide = (flags & 0x10) != 0;
 
-			transformEntry(loginData);
-			_database.push_back(std::move(loginData));
+			entries.push_back(std::move(loginData));
 		}
+
+		transformEntries(entries.begin(), entries.end());
 	}
 
-	std::vector<std::uint8_t> serializeBinary()
+	void mergeFromEncryptedFile(const std::string& filename)
 	{
-		_lastSerialize = std::time(nullptr);
+		std::error_code ec;
+		const auto size = std::experimental::filesystem::file_size(filename, ec);
 
-		auto nEntries = static_cast<std::uint32_t>(std::min(std::size_t{ 0xFFFFFFFF }, _database.size()));
+		if (!ec && size >= _mappedLoadThreshold)
+		{
+			mergeFromMappedFile(filename);
+			return;
+		}
 
-		std::vector<std::uint8_t> buffer(128);
+		FileHandle file(std::fopen(filename.c_str(), "rb"));
 
-		std::memcpy(&buffer[16], &FF_VER, sizeof FF_VER);
-		_randomGenerator.extract(&buffer[32], 32); // Generating nonce
-		std::memcpy(&buffer[96], &_lastSerialize, sizeof _lastSerialize);
-		std::memcpy(&buffer[104], &nEntries, sizeof nEntries);
+		if (file == nullptr)
+		{
+			throw std::runtime_error("Unable to open database file.");
+		}
 
-		const auto writeToBuffer = [&](const void* data, std::size_t size)
+		const auto readFromFile = [&](std::uint8_t* buffer, std::size_t size)
 		{
-			const auto bufferSize = buffer.size();
-			buffer.resize(bufferSize + size);
-			std::memcpy(buffer.data() + bufferSize, data, size);
+			const auto n = std::fread(buffer, 1, size, file.get());
+
+			if (n < size && std::ferror(file.get()))
+			{
+				throw std::runtime_error("Unable to read database file.");
+			}
+
+			return n;
 		};
 
-		const auto writeString = [&](const std::string& s)
+		std::array<std::uint8_t, 160> header = {};
+		std::vector<std::uint8_t, SecureAllocator<std::uint8_t>> chunk(streamChunkSize());
+
+		if (readFromFile(header.data(), 96) < 96)
 		{
-			const auto size = static_cast<std::uint16_t>(std::min(std::size_t{ 0xFFFF }, s.size()));
-			writeToBuffer(&size, sizeof size);
-			writeToBuffer(s.data(), size);
+			throw std::runtime_error("Database file too small.");
+		}
+
+		const auto minorVersion = checkFileFormatVersion(header.data());
+		const bool wrapped = minorVersion >= 12;
+		const std::size_t headerRead = 96 + readFromFile(&header[96], fileHeaderSize(minorVersion) - 96);
+
+		const auto fileSize = std::max<std::uint64_t>(headerRead, fileSizeOf(file.get()));
+
+		if (fileSize < 128)
+		{
+			throw std::runtime_error("Database file too small.");
+		}
+
+		// The hash is checked first, so damaged files don't go through the key derivation.
+		// Before 2.12 it covers the whole file, which takes a pass of its own.
+		FileHasher hasher(minorVersion, &header[16], headerRead - 16);
+
+		if (!wrapped)
+		{
+			for (std::size_t n; (n = readFromFile(chunk.data(), chunk.size())) > 0; )
+			{
+				hasher.update(chunk.data(), n);
+			}
+
+			if (!seekFile(file.get(), headerRead))
+			{
+				throw std::runtime_error("Unable to read database file.");
+			}
+		}
+
+		std::array<std::uint8_t, 16> actualHash;
+		hasher.finish(&actualHash[0], 16);
+
+		if (std::memcmp(&header[0], &actualHash[0], 16) != 0)
+		{
+			throw std::runtime_error("File was damaged.");
+		}
+
+		const auto bodyOffset = checkFileHeader(header.data(), fileSize);
+
+		std::array<std::uint8_t, 32> enckey;
+		std::array<std::uint8_t, 32> mackey;
+		VolatileZeroGuard keyZeroGuard(&enckey, sizeof enckey);
+		VolatileZeroGuard macZeroGuard(&mackey, sizeof mackey);
+		deriveFileKeys(header.data(), enckey, mackey);
+
+		if (wrapped && std::memcmp(&mackey[0], &header[64], 32) != 0)
+		{
+			clearFileKeyCache(); // Don't keep a key derived from the wrong password.
+			throw std::runtime_error("Wrong password.");
+		}
+
+		FileHasher macHasher(minorVersion, mackey.data(), mackey.size());
+		macHasher.update(&header[16], 16);
+		macHasher.update(&header[96], bodyOffset - 96);
+
+		BodyDecrypter decrypter(enckey.data(), enckey.size());
+		VolatileZeroGuard decrypterZeroGuard(&decrypter, sizeof decrypter);
+
+		if (wrapped)
+		{
+			decrypter.begin(&header[16], 112);
+		}
+
+		std::uint64_t blockIndex = 0;
+
+		ChunkedReader reader(chunk.data(), chunk.size(), [&](std::uint8_t* buffer, std::size_t size)
+		{
+			const auto n = readFromFile(buffer, size);
+
+			if (wrapped)
+			{
+				decrypter.transform(buffer, buffer, n);
+				return n;
+			}
+
+			forEachSlice(n, [&](std::size_t offset, std::size_t sliceSize)
+			{
+				const auto slice = &buffer[offset];
+				macHasher.update(slice, sliceSize);
+				transformFileBody(enckey, slice, slice, sliceSize, blockIndex);
+				blockIndex += sliceSize / 64;
+			});
+
+			return n;
+		});
+
+		const auto verifyMac = [&]()
+		{
+			for (std::size_t n; (n = readFromFile(chunk.data(), chunk.size())) > 0; )
+			{
+				if (wrapped)
+				{
+					decrypter.transform(chunk.data(), chunk.data(), n);
+				}
+				else
+				{
+					macHasher.update(chunk.data(), n);
+				}
+			}
+
+			if (wrapped)
+			{
+				std::array<std::uint8_t, 32> tag;
+				decrypter.finish(tag.data(), tag.size());
+
+				if (std::memcmp(&tag[0], &header[128], 32) != 0)
+				{ // The key check passed, so the password is right.
+					throw std::runtime_error("File was damaged.");
+				}
+
+				return;
+			}
+
+			auto calculatedMac = macHasher.finish();
+
+			// No need to worry about timing attacks, correct MAC is obviously known to anyone.
+			if (std::memcmp(&calculatedMac[0], &header[64], 32) != 0)
+			{
+				clearFileKeyCache(); // Don't keep a key derived from the wrong password.
+				throw std::runtime_error("Wrong password.");
+			}
 		};
 
-		for (auto& entry : _database)
+		std::time_t lastSerialize;
+		std::vector<LoginData, SecureAllocator<LoginData>> entries;
+
+		// Entries are parsed before the mac is known, they are only used after it has been checked.
+		try
 		{
-			if (entry.snapshots.size() > 0xFFFF)
-			{ // This will *never* happen in normal usage. (Nobody changes the password for a service over 65,000 times.)
-				throw std::invalid_argument("Too many snapshots in database entry."
-					" Please use text export and manually erase them.");
+			parseFileBody(reader, lastSerialize, entries);
+		}
+		catch (std::runtime_error&)
+		{ // A wrong password is the more helpful error.
+			verifyMac();
+			throw;
+		}
+
+		verifyMac();
+
+		_lastSerialize = lastSerialize;
+
+		for (auto& loginData : entries)
+		{
+			pushEntry(std::move(loginData));
+		}
+	}
+
+	// Hash and mac run directly over the mapping, the body is decrypted into one locked buffer.
+	// Mac and decryption happen slice by slice in the same pass (see forEachSlice()).
+	void mergeFromMappedFile(const std::string& filename)
+	{
+		MappedFile file(filename);
+		const auto data = file.data();
+		const auto size = file.size();
+
+		if (size < 128)
+		{
+			throw std::runtime_error("Database file too small.");
+		}
+
+		const auto minorVersion = checkFileFormatVersion(data);
+		const bool wrapped = minorVersion >= 12;
+		const auto hashedSize = wrapped ? std::min<std::uint64_t>(size, fileHeaderSize(minorVersion)) : size;
+
+		// Like in mergeFromEncryptedFile(), the hash is checked before the key derivation.
+		std::array<std::uint8_t, 16> actualHash;
+		FileHasher(minorVersion, &data[16], hashedSize - 16).finish(&actualHash[0], 16);
+
+		if (std::memcmp(&data[0], &actualHash[0], 16) != 0)
+		{
+			throw std::runtime_error("File was damaged.");
+		}
+
+		const auto bodyOffset = checkFileHeader(data, size);
+
+		std::array<std::uint8_t, 32> enckey;
+		std::array<std::uint8_t, 32> mackey;
+		VolatileZeroGuard keyZeroGuard(&enckey, sizeof enckey);
+		VolatileZeroGuard macZeroGuard(&mackey, sizeof mackey);
+		deriveFileKeys(data, enckey, mackey);
+
+		std::vector<std::uint8_t, SecureAllocator<std::uint8_t>> body(size - bodyOffset);
+
+		if (wrapped)
+		{
+			if (std::memcmp(&mackey[0], &data[64], 32) != 0)
+			{
+				clearFileKeyCache(); // Don't keep a key derived from the wrong password.
+				throw std::runtime_error("Wrong password.");
 			}
 
-			auto guard = transformGuard(entry);
+			std::array<std::uint8_t, 32> tag;
+			BodyDecrypter decrypter(enckey.data(), enckey.size());
+			decrypter(&data[16], 112, body.data(), &data[bodyOffset], body.size(), tag.data(), tag.size());
+			volatileZeroMemory(&decrypter, sizeof decrypter);
 
-			const auto nSnapshots = static_cast<std::uint16_t>(entry.snapshots.size());
-			writeToBuffer(&entry.uniqueId, sizeof entry.uniqueId);
-			writeToBuffer(&entry.timestamp, sizeof entry.timestamp);
-			writeToBuffer(&nSnapshots, sizeof nSnapshots);
+			if (std::memcmp(&tag[0], &data[128], 32) != 0)
+			{ // The key check passed, so the password is right.
+				throw std::runtime_error("File was damaged.");
+			}
+		}
+		else
+		{
+			FileHasher macHasher(minorVersion, mackey.data(), mackey.size());
+			macHasher.update(&data[16], 16);
+			macHasher.update(&data[96], bodyOffset - 96);
 
-			for (std::size_t i = 0; i < nSnapshots; ++i)
+			forEachSlice(body.size(), [&](std::size_t offset, std::size_t sliceSize)
 			{
-				auto& snapshot = entry.snapshots[i];
-				writeToBuffer(&snapshot.timestamp, sizeof snapshot.timestamp);
-				writeString(snapshot.username);
-				writeString(snapshot.password);
+				const auto slice = &data[bodyOffset + offset];
+				macHasher.update(slice, sliceSize);
+				transformFileBody(enckey, &body[offset], slice, sliceSize, offset / 64);
+			});
+
+			auto calculatedMac = macHasher.finish();
+
+			// No need to worry about timing attacks, correct MAC is obviously known to anyone.
+			if (std::memcmp(&calculatedMac[0], &data[64], 32) != 0)
+			{
+				clearFileKeyCache(); // Don't keep a key derived from the wrong password.
+				throw std::runtime_error("Wrong password.");
 			}
+		}
 
-			writeString(entry.name);
-			writeString(entry.comment);
-			writeString(entry.generatorDesc.extraAlphabet);
+		std::time_t lastSerialize;
+		std::vector<LoginData, SecureAllocator<LoginData>> entries;
+		MemoryReader memoryReader(body.data(), body.size());
+		parseFileBody(memoryReader, lastSerialize, entries);
 
-			std::uint16_t flags = 0;
-			flags |= (entry.generatorDesc.genLetters << 0u);
-			flags |= (entry.generatorDesc.genNumbers << 1u);
-			flags |= (entry.generatorDesc.genSpecial << 2u);
-			flags |= (entry.generatorDesc.genExtra << 3u);
-			flags |= (entry.hide << 4u);
+		_lastSerialize = lastSerialize;
 
-			writeToBuffer(&entry.generatorDesc.passwordLength, sizeof entry.generatorDesc.passwordLength);
-			writeToBuffer(&flags, sizeof flags);
+		for (auto& loginData : entries)
+		{
+			pushEntry(std::move(loginData));
 		}
+	}
 
-		// Derive keys
-		std::array<std::uint8_t, 32> nonce;
-		std::memcpy(&nonce[0], &buffer[32], 32);
-		transformString(_tempKey, _password, 0, 0);
-		auto enckey = deriveKey(_password, nonce, "ENC-KEY");
-		auto mackey = deriveKey(_password, nonce, "MAC-KEY");
-		transformString(_tempKey, _password, 0, 0);
+	// Encrypts the body chunk by chunk on its way to the file, so it never holds more than one chunk of it.
+	// Goes to a temporary file first, so the old file stays intact until the new one is complete.
+	void writeToEncryptedFile(const std::string& filename)
+	{
+		checkSerializable();
+
+		auto header = makeFileHeader();
+
+		std::array<std::uint8_t, 32> enckey;
+		std::array<std::uint8_t, 32> mackey;
+		VolatileZeroGuard keyZeroGuard(&enckey, sizeof enckey);
+		VolatileZeroGuard macZeroGuard(&mackey, sizeof mackey);
+		deriveFileKeys(header.data(), enckey, mackey);
+
+		const auto tempFilename = filename + ".tmp";
+		FileHandle file(std::fopen(tempFilename.c_str(), "w+b"));
+
+		if (file == nullptr)
+		{
+			throw std::runtime_error("Unable to open database file for writing.");
+		}
+
+		try
+		{
+			if (!reserveFileSpace(file.get(), fileHeaderSize(_saveMinorVersion) + serializedBodySize()))
+			{
+				throw std::runtime_error("Not enough disk space to write database file.");
+			}
 
-		// Encrypt data
-		Cipher cipher(chacha::key_bits<256>(), enckey.data(), 0);
-		cipher.transform(&buffer[96], &buffer[96], buffer.size() - 96);
+			writeToEncryptedFile(file.get(), enckey, mackey, header);
+		}
+		catch (...)
+		{
+			file.reset();
+			std::remove(tempFilename.c_str());
+			throw;
+		}
+
+		file.reset();
+
+		if (!replaceFile(tempFilename, filename))
+		{
+			std::remove(tempFilename.c_str());
+			throw std::runtime_error("Unable to replace database file.");
+		}
+	}
 
-		// Calculate mac
-		Hasher hasher(mackey.data(), mackey.size());
-		hasher.update(&buffer[16], 16);
-		hasher.update(&buffer[96], buffer.size() - 96);
-		hasher.finish(&buffer[64], 32);
+	// Writes header and body to file and syncs it to the disk.
+	void writeToEncryptedFile(std::FILE* file, const std::array<std::uint8_t, 32>& enckey,
+		const std::array<std::uint8_t, 32>& mackey, std::array<std::uint8_t, 160>& header)
+	{
+		const auto writeToFile = [&](const void* data, std::size_t size)
+		{
+			if (std::fwrite(data, 1, size, file) != size)
+			{
+				throw std::runtime_error("Unable to write database file.");
+			}
+		};
+
+		const auto headerSize = fileHeaderSize(_saveMinorVersion);
 
-		volatileZeroMemory(&cipher, sizeof cipher);
-		volatileZeroMemory(&enckey, sizeof enckey);
-		volatileZeroMemory(&mackey, sizeof mackey);
+		writeToFile(header.data(), headerSize);
+		writeEncryptedBody(header.data(), enckey, mackey, writeToFile);
 
-		// Calculate hash to differentiate between a wrong password and a damaged file.
-		Hasher(&buffer[16], buffer.size() - 16).finish(&buffer[0], 16);
+		if (_saveMinorVersion < 11)
+		{ // The hash covers the mac, which is only known now. Read the body back instead of keeping it.
+			FileHasher hasher(_saveMinorVersion, &header[16], headerSize - 16);
+			std::vector<std::uint8_t> chunk(streamChunkSize());
 
-		return buffer;
+			if (!seekFile(file, headerSize))
+			{
+				throw std::runtime_error("Unable to read database file.");
+			}
+
+			for (std::size_t n; (n = std::fread(chunk.data(), 1, chunk.size(), file)) > 0; )
+			{
+				hasher.update(chunk.data(), n);
+			}
+
+			if (std::ferror(file))
+			{
+				throw std::runtime_error("Unable to read database file.");
+			}
+
+			hasher.finish(&header[0], 16);
+		}
+
+		if (!seekFile(file, 0))
+		{
+			throw std::runtime_error("Unable to write database file.");
+		}
+
+		writeToFile(header.data(), headerSize);
+
+		if (!syncFile(file))
+		{
+			throw std::runtime_error("Unable to write database file.");
+		}
 	}
 
 	void mergeFromText(const char* text)
@@ -733,7 +1581,7 @@ public:
 			else
 			{
 				transformEntry(data);
-				_database.push_back(std::move(data));
+				pushEntry(std::move(data));
 			}
 		}
 	}
@@ -39,7 +39,7 @@ inline PasswordGeneratorDesc makeGeneratorDesc(HWND hwnd)
 
 	auto n = GetDlgItemInt(hwnd, DIALOG_EDITDATA_EDIT_PWLENGTH, nullptr, false);
 	generatorDesc.passwordLength = static_cast<std::uint16_t>(std::min(0xFFFFu, std::max(1u, n)));
-	generatorDesc.extraAlphabet = getWindowText(GetDlgItem(hwnd, DIALOG_EDITDATA_EDIT_EXTRA));
+	generatorDesc.extraAlphabet = getWindowText<SecureAllocator<char>>(GetDlgItem(hwnd, DIALOG_EDITDATA_EDIT_EXTRA));
 
 	return generatorDesc;
 }
@@ -68,17 +68,15 @@ inline void saveEditedData(HWND hwnd, EditDialogData* dialog)
 	auto guard = dialog->database->transformGuard(*data);	
 	
 	data->timestamp = std::time(nullptr);
-	data->name = getWindowText(GetDlgItem(hwnd, DIALOG_EDITDATA_EDIT_NAME));
-	data->comment = getWindowText(GetDlgItem(hwnd, DIALOG_EDITDATA_EDIT_COMMENT));
+	data->name = getWindowText<SecureAllocator<char>>(GetDlgItem(hwnd, DIALOG_EDITDATA_EDIT_NAME));
+	data->comment = getWindowText<SecureAllocator<char>>(GetDlgItem(hwnd, DIALOG_EDITDATA_EDIT_COMMENT));
 	data->generatorDesc = makeGeneratorDesc(hwnd);
 
 	Snapshot snapshot;
-	snapshot.username = getWindowText(GetDlgItem(hwnd, DIALOG_EDITDATA_EDIT_USERNAME));
-	snapshot.password = getWindowText(GetDlgItem(hwnd, DIALOG_EDITDATA_EDIT_PASSWORD));
+	snapshot.username = getWindowText<SecureAllocator<char>>(GetDlgItem(hwnd, DIALOG_EDITDATA_EDIT_USERNAME));
+	snapshot.password = getWindowText<SecureAllocator<char>>(GetDlgItem(hwnd, DIALOG_EDITDATA_EDIT_PASSWORD));
 	snapshot.timestamp = std::time(nullptr);
 
-	auto str = toWideString(snapshot.password);
-
 	if (data->snapshots.size() == 0 || 
 		data->snapshots.back().username != snapshot.username || 
 		data->snapshots.back().password != snapshot.password)
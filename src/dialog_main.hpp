@@ -2,6 +2,7 @@
 
 #include "database.hpp"
 
+#include <future>
 #include <map>
 
 #include "resource.h"
@@ -81,7 +82,8 @@ void emulateReleaseHotkey(const ProgramSettings& settings)
 	timeEndPeriod(1);
 }
 
-void writeString(HWND, const std::string& str)
+template <typename Allocator>
+void writeString(HWND, const std::basic_string<char, std::char_traits<char>, Allocator>& str)
 {
 	timeBeginPeriod(1);
 
@@ -132,6 +134,8 @@ class MainDialog
 	ProgramSettings _settings;
 	std::string _configFile;
 
+	std::future<KdfParameters> _kdfCalibration;
+
 public:
 	~MainDialog()
 	{
@@ -174,8 +178,21 @@ public:
 		node.loadOrStore("hotkey.autotyper_alt", _settings.autotyperHotkeySettings.alt);
 		node.loadOrStore("show_hidden_entries", _settings.showHiddenEntries);
 		node.loadOrStore("always_on_top", _settings.alwaysOnTop);
+		node.loadOrStore("cipher.parallel_threshold", _settings.parallelCipherThreshold);
+		node.loadOrStore("load.mapped_threshold", _settings.mappedLoadThreshold);
+		node.loadOrStore("kdf.target_time", _settings.kdfTargetTime);
+		node.loadOrStore("kdf.iterations", _settings.kdfIterations);
+		node.loadOrStore("kdf.memory_kib", _settings.kdfMemoryKiB);
+		node.loadOrStore("kdf.lanes", _settings.kdfLanes);
+		node.loadOrStore("kdf.cache_file_key", _settings.cacheFileKey);
+		node.loadOrStore("file.save_format_version", _settings.saveFormatVersion);
 
 		setAlwaysOnTop(hwnd, _settings.alwaysOnTop);
+		_database->setParallelCipherThreshold(_settings.parallelCipherThreshold);
+		_database->setMappedLoadThreshold(_settings.mappedLoadThreshold);
+		applyKdfSettings(hwnd);
+		_database->setFileKeyCaching(_settings.cacheFileKey);
+		applySaveFormatSetting();
 
 		if (charbuf0.size() > 1)
 		{
@@ -218,9 +235,16 @@ public:
 
 	void writeDatabaseToFile()
 	{
-		auto buf = _database->serializeBinary();
-		FileHandle file(std::fopen(_storeFilename->c_str(), "wb"));
-		std::fwrite(buf.data(), 1, buf.size(), file.get());
+		finishKdfCalibration();
+
+		try
+		{
+			_database->writeToEncryptedFile(*_storeFilename);
+		}
+		catch (std::exception& e)
+		{
+			showMessageBox("Error", e.what());
+		}
 	}
 
 	void remakeNotifyIcon(HWND hwnd)
@@ -250,6 +274,71 @@ public:
 			mod1, _settings.autotyperHotkeySettings.character);
 	}
 
+	// Calibration takes about kdfTargetTime and up to kdfMemoryKiB, so it runs on a thread of its own.
+	// WM_KDF_CALIBRATED brings the result, a save before that waits for it.
+	void applyKdfSettings(HWND hwnd)
+	{
+		KdfParameters params;
+		params.iterations = _settings.kdfIterations;
+		params.memoryKiB = _settings.kdfMemoryKiB;
+		params.lanes = static_cast<std::uint8_t>(std::min(_settings.kdfLanes, 255u));
+
+		if (validKdfParameters(params))
+		{
+			_database->setKdfParameters(params);
+			return;
+		}
+
+		const auto targetTime = std::chrono::milliseconds(_settings.kdfTargetTime);
+		const auto maxMemoryKiB = _settings.kdfMemoryKiB;
+
+		_kdfCalibration = std::async(std::launch::async, [=]()
+		{
+			const auto result = calibrateKdfParameters(targetTime, maxMemoryKiB, params.lanes);
+			PostMessageW(hwnd, WM_KDF_CALIBRATED, 0, 0);
+			return result;
+		});
+	}
+
+	// Applies and stores the calibrated parameters, if a calibration was started and not taken yet.
+	void finishKdfCalibration()
+	{
+		if (!_kdfCalibration.valid())
+		{
+			return;
+		}
+
+		try
+		{
+			const auto params = _kdfCalibration.get();
+
+			_settings.kdfIterations = params.iterations;
+			_settings.kdfMemoryKiB = params.memoryKiB;
+			_settings.kdfLanes = params.lanes;
+
+			_database->setKdfParameters(params);
+			storeConfigFile();
+		}
+		catch (std::exception& e)
+		{ // The database keeps its default parameters, the next start calibrates again.
+			showMessageBox("Error", e.what());
+		}
+	}
+
+	// An older version keeps files readable by builds that stop at 2.10 or 2.11, unknown ones fall back to the newest.
+	void applySaveFormatSetting()
+	{
+		try
+		{
+			_database->setSaveFormatVersion(static_cast<std::uint16_t>(std::min(_settings.saveFormatVersion, 0xFFFFu)));
+		}
+		catch (std::invalid_argument&)
+		{
+			_settings.saveFormatVersion = 0;
+			_database->setSaveFormatVersion(0);
+		}
+	}
+
 	void storeConfigFile()
 	{
 		std::string charbuf0(1, _settings.clipboardHotkeySettings.character);
@@ -272,6 +361,14 @@ public:
 		node.storeValue("hotkey.autotyper_alt", _settings.autotyperHotkeySettings.alt);
 		node.storeValue("show_hidden_entries", _settings.showHiddenEntries);
 		node.storeValue("always_on_top", _settings.alwaysOnTop);
+		node.storeValue("cipher.parallel_threshold", _settings.parallelCipherThreshold);
+		node.storeValue("load.mapped_threshold", _settings.mappedLoadThreshold);
+		node.storeValue("kdf.target_time", _settings.kdfTargetTime);
+		node.storeValue("kdf.iterations", _settings.kdfIterations);
+		node.storeValue("kdf.memory_kib", _settings.kdfMemoryKiB);
+		node.storeValue("kdf.lanes", _settings.kdfLanes);
+		node.storeValue("kdf.cache_file_key", _settings.cacheFileKey);
+		node.storeValue("file.save_format_version", _settings.saveFormatVersion);
 	}
 
 	void updateSelection(int index)
@@ -367,7 +464,7 @@ public:
 
 		if (data)
 		{
-			auto clipboardString = copyFromClipboard();
+			auto clipboardString = toSecureString(copyFromClipboard());
 			auto guard = database().transformGuard(*data);
 
 			if (data->snapshots.back().username == clipboardString ||
@@ -431,6 +528,22 @@ public:
 		updateListbox(hwnd);
 	}
 
+	// Large databases are scored in the background, WM_SEARCH_FINISHED brings the result.
+	void startSearch(HWND hwnd)
+	{
+		database().startSort(getWindowText(GetDlgItem(hwnd, DIALOG_MAIN_EDIT_SEARCH)), [hwnd] {
+			PostMessageW(hwnd, WM_SEARCH_FINISHED, 0, 0);
+		});
+	}
+
+	void finishSearch(HWND hwnd)
+	{
+		if (database().finishSort())
+		{
+			updateListbox(hwnd);
+		}
+	}
+
 	void hideOrShowEntry(HWND hwnd, int index)
 	{
 		auto data = database().getEntry(static_cast<std::size_t>(index));
@@ -502,6 +615,16 @@ INT_PTR CALLBACK dialogProcMain(HWND hwnd, UINT message, WPARAM wparam, LPARAM l
 		dialog->updateSearchStringAndListbox(hwnd);
 	}	return true;
 
+	case WM_SEARCH_FINISHED:
+	{
+		dialog->finishSearch(hwnd);
+	}	return true;
+
+	case WM_KDF_CALIBRATED:
+	{
+		dialog->finishKdfCalibration();
+	}	return true;
+
 	case WM_SETTINGS_APPLIED:
 	{
 		dialog->registerHotkeys(hwnd);
@@ -752,7 +875,7 @@ INT_PTR CALLBACK dialogProcMain(HWND hwnd, UINT message, WPARAM wparam, LPARAM l
 		{
 			if (HIWORD(wparam) == EN_CHANGE)
 			{
-				dialog->updateSearchStringAndListbox(hwnd);
+				dialog->startSearch(hwnd);
 			}
 		}	return true;
 
@@ -37,8 +37,8 @@ INT_PTR CALLBACK dialogProcMergeText(HWND hwnd, UINT message, WPARAM wparam, LPA
 
 		case DIALOG_MERGETEXT_BUTTON_MERGE:
 		{
-			// The data will be everywhere in memory and there's nothing we can do about it.
-			database->mergeFromText(getWindowText(GetDlgItem(hwnd, DIALOG_MERGETEXT_EDIT_TEXT)).c_str());
+			// The edit control keeps its own copy, but ours at least stays in locked memory.
+			database->mergeFromText(getWindowText<SecureAllocator<char>>(GetDlgItem(hwnd, DIALOG_MERGETEXT_EDIT_TEXT)).c_str());
 			PostMessageW(parent, WM_CHANGES_SAVED, 0, 0);
 			PostMessageW(hwnd, WM_CLOSE, 0, 0);
 		}	return true;
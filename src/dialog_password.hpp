@@ -1,12 +1,13 @@
 #pragma once
 
 #include "resource.h"
+#include "secure_memory.hpp"
 #include "windows/utility.hpp"
 
 class PasswordDialogCreateParams
 {
 public:
-	std::string* password = nullptr;
+	SecureString* password = nullptr;
 	std::string* filename = nullptr;
 	std::unique_ptr<NotifyIcon> notifyIcon;
 	UINT taskbarCreatedMessage = RegisterWindowMessageW(L"TaskbarCreated");
@@ -103,14 +104,7 @@ INT_PTR CALLBACK dialogProcPassword(HWND hwnd, UINT message, WPARAM wparam, LPAR
 		{
 			*params->filename = getWindowText(GetDlgItem(hwnd, DIALOG_PASSWORD_EDIT_FILENAME));
 
-			auto& password = *params->password;
-
-			wchar_t buffer[2400];
-			GetWindowTextW(GetDlgItem(hwnd, DIALOG_PASSWORD_EDIT_PASSWORD), buffer, sizeof buffer);
-
-			SecureZeroMemory(&password[0], password.size()); // &password[0] is always valid
-			password = toUtf8(buffer);
-			SecureZeroMemory(buffer, sizeof buffer);
+			*params->password = getWindowText<SecureAllocator<char>>(GetDlgItem(hwnd, DIALOG_PASSWORD_EDIT_PASSWORD));
 
 			EndDialog(hwnd, 1);
 		}	return true;
@@ -30,11 +30,22 @@ struct ProgramSettings
 	std::uint32_t idleTimeout = 20 * 60 * 1000;
 	std::uint32_t selectionTimeout = 5 * 60 * 1000;
 
+	std::uint32_t parallelCipherThreshold = 1024 * 1024;
+	std::uint32_t mappedLoadThreshold = 8 * 1024 * 1024;
+
+	std::uint32_t kdfTargetTime = 1000;
+	std::uint32_t kdfIterations = 0; // 0 = calibrate on next start
+	std::uint32_t kdfMemoryKiB = 256 * 1024; // Upper bound while calibrating
+	std::uint32_t kdfLanes = 4;
+
+	std::uint32_t saveFormatVersion = 0; // Minor version, 0 = newest
+
 	HotkeySettings clipboardHotkeySettings = { 'B', false, true, false };
 	HotkeySettings autotyperHotkeySettings = { 'Q', false, true, false };
 
 	bool showHiddenEntries = false;
 	bool alwaysOnTop = true;
+	bool cacheFileKey = false;
 };
 
 inline int shortTimeoutToIndex(std::uint32_t timeout)
@@ -39,7 +39,7 @@ INT_PTR CALLBACK dialogProcShowDatabase(HWND hwnd, UINT message, WPARAM wparam,
 
 		case DIALOG_SHOWDATABASE_BUTTON_COPY:
 		{
-			copyToClipboard(getWindowText(GetDlgItem(hwnd, DIALOG_SHOWDATABASE_EDIT_TEXT)));
+			copyToClipboard(getWindowText<SecureAllocator<char>>(GetDlgItem(hwnd, DIALOG_SHOWDATABASE_EDIT_TEXT)));
 		}	return true;
 		}
 	}	break;
@@ -5,82 +5,474 @@
 #include <cctype>
 #include <cstdint>
 #include <algorithm>
+#include <limits>
 #include <string>
 #include <vector>
 
+// Myers' bit-parallel edit distance (in Hyyroe's formulation).
+// The pattern is split into blocks of 64 characters, one bit per character.
+// distance() compares against the whole text, substringDistance() against the best matching part of it.
+class LevenshteinPattern
+{
+	std::size_t _size = 0;
+	std::size_t _nBlocks = 0;
+	std::vector<std::uint64_t> _peq; // [character * _nBlocks + block], bit set where pattern has character
+
+public:
+	LevenshteinPattern() {}
+
+	LevenshteinPattern(const char* pattern, std::size_t size)
+		: _size(size)
+		, _nBlocks((size + 63) / 64)
+		, _peq(256 * _nBlocks)
+	{
+		for (std::size_t i = 0; i < size; ++i)
+		{
+			_peq[static_cast<unsigned char>(pattern[i]) * _nBlocks + i / 64] |= std::uint64_t{ 1 } << (i % 64);
+		}
+	}
+
+	explicit LevenshteinPattern(const std::string& pattern)
+		: LevenshteinPattern(pattern.data(), pattern.size())
+	{}
+
+	std::size_t size() const
+	{
+		return _size;
+	}
+
+	std::uint32_t distance(const char* text, std::size_t textSize) const
+	{
+		return run(text, textSize, false);
+	}
+
+	std::uint32_t distance(const std::string& text) const
+	{
+		return distance(text.data(), text.size());
+	}
+
+	// Semi-global distance: the match may start and end anywhere in the text.
+	std::uint32_t substringDistance(const char* text, std::size_t textSize) const
+	{
+		return run(text, textSize, true);
+	}
+
+	std::uint32_t substringDistance(const std::string& text) const
+	{
+		return substringDistance(text.data(), text.size());
+	}
+
+private:
+	std::uint32_t run(const char* text, std::size_t textSize, bool freeStart) const
+	{
+		if (_size == 0)
+		{
+			return freeStart ? 0 : static_cast<std::uint32_t>(textSize);
+		}
+
+		return _nBlocks == 1
+			? runSingleBlock(text, textSize, freeStart)
+			: runBlocked(text, textSize, freeStart);
+	}
+
+	std::uint32_t runSingleBlock(const char* text, std::size_t textSize, bool freeStart) const
+	{
+		const std::uint64_t highBit = std::uint64_t{ 1 } << (_size - 1);
+
+		// The first row of the matrix grows by one per column, unless the match may start anywhere.
+		const std::uint64_t firstRowDelta = freeStart ? 0 : 1;
+
+		std::uint64_t pv = ~std::uint64_t{ 0 };
+		std::uint64_t mv = 0;
+		auto score = static_cast<std::uint32_t>(_size);
+		auto best = score;
+
+		for (std::size_t j = 0; j < textSize; ++j)
+		{
+			const auto eq = _peq[static_cast<unsigned char>(text[j])];
+			const auto xv = eq | mv;
+			const auto xh = (((eq & pv) + pv) ^ pv) | eq;
+
+			auto ph = mv | ~(xh | pv);
+			auto mh = pv & xh;
+
+			if (ph & highBit)
+				++score;
+			else if (mh & highBit)
+				--score;
+
+			best = std::min(best, score);
+
+			ph = (ph << 1) | firstRowDelta;
+			mh = mh << 1;
+
+			pv = mh | ~(xv | ph);
+			mv = ph & xv;
+		}
+
+		return freeStart ? best : score;
+	}
+
+	std::uint32_t runBlocked(const char* text, std::size_t textSize, bool freeStart) const
+	{
+		const std::uint64_t lastHighBit = std::uint64_t{ 1 } << ((_size - 1) % 64);
+
+		std::vector<std::uint64_t> pv(_nBlocks, ~std::uint64_t{ 0 });
+		std::vector<std::uint64_t> mv(_nBlocks, 0);
+		auto score = static_cast<std::uint32_t>(_size);
+		auto best = score;
+
+		for (std::size_t j = 0; j < textSize; ++j)
+		{
+			const auto eqColumn = &_peq[static_cast<unsigned char>(text[j]) * _nBlocks];
+
+			// Horizontal delta entering the block from above.
+			int hin = freeStart ? 0 : 1;
+
+			for (std::size_t b = 0; b < _nBlocks; ++b)
+			{
+				auto eq = eqColumn[b];
+				const auto xv = eq | mv[b];
+
+				if (hin < 0)
+					eq |= 1;
+
+				const auto xh = (((eq & pv[b]) + pv[b]) ^ pv[b]) | eq;
+
+				auto ph = mv[b] | ~(xh | pv[b]);
+				auto mh = pv[b] & xh;
+
+				// Bits above the pattern's end in the last block never influence the ones below.
+				const auto highBit = b + 1 == _nBlocks ? lastHighBit : std::uint64_t{ 1 } << 63;
+				const int hout = (ph & highBit) ? 1 : (mh & highBit) ? -1 : 0;
+
+				ph <<= 1;
+				mh <<= 1;
+
+				if (hin < 0)
+					mh |= 1;
+				else if (hin > 0)
+					ph |= 1;
+
+				pv[b] = mh | ~(xv | ph);
+				mv[b] = ph & xv;
+
+				hin = hout;
+			}
+
+			score += hin;
+			best = std::min(best, score);
+		}
+
+		return freeStart ? best : score;
+	}
+};
+
+inline std::uint32_t levenshteinDistance(const char* s0, std::size_t s0Size, const char* s1, std::size_t s1Size)
+{ // The shorter string makes the cheaper pattern.
+	return s0Size <= s1Size
+		? LevenshteinPattern(s0, s0Size).distance(s1, s1Size)
+		: LevenshteinPattern(s1, s1Size).distance(s0, s0Size);
+}
+
 inline std::uint32_t levenshteinDistance(const std::string& s0, const std::string& s1)
 {
-	constexpr std::uint16_t colSize = 4096;
+	return levenshteinDistance(s0.data(), s0.size(), s1.data(), s1.size());
+}
+
+// Lower case words, the form wordBasedEditDistance() compares.
+inline std::vector<std::string> parseSearchWords(const std::string& source)
+{
+	auto words = parseWords(source);
+
+	for (auto& word : words)
+	{
+		for (auto& c : word)
+		{
+			if (std::isalpha(c))
+			{
+				c = std::tolower(c);
+			}
+		}
+	}
+
+	return words;
+}
+
+// Caches parseSearchWords() of a string until the string changes.
+class SearchWordCache
+{
+	std::string _source;
+	std::vector<std::string> _words;
+	std::uint32_t _generation = 0; // Incremented on every parse, 0 if never parsed
+
+public:
+	const std::vector<std::string>& words(const std::string& source)
+	{
+		return words(source.data(), source.size());
+	}
+
+	const std::vector<std::string>& words(const char* source, std::size_t size)
+	{
+		if (_generation == 0 || _source.compare(0, _source.size(), source, size) != 0)
+		{
+			_source.assign(source, size);
+			_words = parseSearchWords(_source);
+			++_generation;
+		}
 
-	if (s0.size() > colSize - 1 || s1.size() > colSize - 1)
+		return _words;
+	}
+
+	// Words of the last parsed string.
+	const std::vector<std::string>& words() const
 	{
-		return 0;
+		return _words;
 	}
 
-	std::uint16_t buf0[colSize];
-	std::uint16_t buf1[colSize];
+	const std::string& source() const
+	{
+		return _source;
+	}
 
-	auto col = buf0;
-	auto prev_col = buf1;
+	std::uint32_t generation() const
+	{
+		return _generation;
+	}
+};
+
+inline std::vector<LevenshteinPattern> makeSearchPatterns(const std::vector<std::string>& searchWords)
+{
+	std::vector<LevenshteinPattern> patterns;
 
-	for (std::uint16_t i = 0; i < colSize; i++)
+	for (const auto& word : searchWords)
 	{
-		prev_col[i] = i;
+		patterns.emplace_back(word);
 	}
 
-	for (std::uint16_t i = 0; i < s0.size(); i++)
+	return patterns;
+}
+
+// Sum over the search words of their best approximate match anywhere inside one of the data words.
+inline std::uint32_t wordBasedEditDistance(const std::vector<LevenshteinPattern>& searchPatterns, 
+	const std::vector<std::string>& dataWords)
+{
+	std::uint32_t distance = 0;
+
+	for (const auto& searchPattern : searchPatterns)
 	{
-		col[0] = i + 1;
+		auto minDistance = std::numeric_limits<std::uint32_t>::max();
 
-		for (std::uint16_t j = 0; j < s1.size(); j++)
+		for (const auto& dataWord : dataWords)
 		{
-			col[j + 1] = std::min({ prev_col[1 + j] + 1, col[j] + 1, prev_col[j] + (s0[i] == s1[j] ? 0 : 1) });
+			minDistance = std::min(minDistance, searchPattern.substringDistance(dataWord));
 		}
 
-		std::swap(col, prev_col);
+		distance += minDistance;
 	}
 
-	return prev_col[s1.size()];
+	return distance;
 }
 
 inline std::uint32_t wordBasedEditDistance(const std::string& searchString, const std::string& dataString)
 {
-	const auto convertToLowerCase = [](std::vector<std::string> words)
+	return wordBasedEditDistance(makeSearchPatterns(parseSearchWords(searchString)), parseSearchWords(dataString));
+}
+
+// wordBasedEditDistance() of a query that is typed one character at a time.
+// The query is the text of the DP and the data words are the patterns, so every
+// appended character adds one column. The columns of the search word that is
+// currently being typed are kept (as bit-parallel vertical deltas), which also allows
+// removing characters from its end. Finished search words are reduced to their distance.
+class IncrementalWordDistance
+{
+	std::vector<std::uint64_t> _pv; // [column * _nBlocks + block], blocks of 64 rows, data words back to back
+	std::vector<std::uint64_t> _mv;
+	std::vector<std::uint32_t> _distances; // Distance of the current search word after every column
+	std::size_t _nBlocks = 0;
+	std::uint32_t _finished = 0; // Sum of the finished search words' distances
+	std::uint32_t _wordsGeneration = 0;
+	std::size_t _wordStart = 0; // Query position of the current search word's first column
+	std::size_t _queryLength = 0;
+
+public:
+	// True if this state was built from the data words of that generation and the first queryLength characters.
+	bool continues(std::uint32_t wordsGeneration, std::size_t queryLength) const
+	{
+		return _wordsGeneration == wordsGeneration && _queryLength == queryLength;
+	}
+
+	// Starts over after the first queryLength characters of a query, which have to end between words.
+	// finished is their wordBasedEditDistance().
+	void reset(std::uint32_t wordsGeneration, std::uint32_t finished = 0, std::size_t queryLength = 0)
 	{
-		for (auto& word : words)
+		_pv.clear();
+		_mv.clear();
+		_distances.clear();
+		_finished = finished;
+		_wordsGeneration = wordsGeneration;
+		_wordStart = queryLength;
+		_queryLength = queryLength;
+	}
+
+	// Forgets the characters of the query from queryLength on.
+	// Returns false if that reaches into a finished search word, which needs a reset().
+	bool truncate(std::size_t queryLength)
+	{
+		if (queryLength > _queryLength || queryLength < _wordStart)
 		{
-			for (auto& c : word)
+			return false;
+		}
+
+		const auto columns = queryLength - _wordStart;
+		_pv.resize(columns * _nBlocks);
+		_mv.resize(columns * _nBlocks);
+		_distances.resize(columns);
+		_queryLength = queryLength;
+
+		return true;
+	}
+
+	// Consumes the characters of query that haven't been seen yet.
+	void extend(const std::string& query, const std::vector<std::string>& dataWords)
+	{
+		for (; _queryLength < query.size(); ++_queryLength)
+		{
+			auto c = query[_queryLength];
+
+			if (std::isspace(c))
+			{
+				finishWord();
+			}
+			else
 			{
 				if (std::isalpha(c))
 				{
 					c = std::tolower(c);
 				}
+
+				addColumn(c, dataWords);
 			}
 		}
+	}
 
-		return words;
-	};
-
-	auto searchWords = convertToLowerCase(parseWords(searchString));
-	auto dataWords = convertToLowerCase(parseWords(dataString));
+	std::uint32_t distance() const
+	{
+		return _distances.empty() ? _finished : _finished + _distances.back();
+	}
 
-	std::uint32_t distance = 0;
+private:
+	void finishWord()
+	{
+		_finished = distance();
+		_pv.clear();
+		_mv.clear();
+		_distances.clear();
+		_wordStart = _queryLength + 1;
+	}
 
-	for (const auto& searchWord : searchWords)
+	void addColumn(char c, const std::vector<std::string>& dataWords)
 	{
-		auto minDistance = std::numeric_limits<std::uint32_t>::max();
+		const auto column = _distances.size();
 
-		for (auto dataWord : dataWords)
+		if (column == 0)
 		{
-			for (std::size_t i = 0; i < dataWord.size(); ++i)
+			_nBlocks = 0;
+
+			for (const auto& word : dataWords)
 			{
-				minDistance = std::min(minDistance, 
-					levenshteinDistance(searchWord, dataWord.substr(i, searchWord.size())));
+				_nBlocks += (word.size() + 63) / 64;
 			}
+
+			_wordStart = _queryLength;
 		}
 
-		distance += minDistance;
-	}
+		_pv.resize((column + 1) * _nBlocks);
+		_mv.resize((column + 1) * _nBlocks);
 
-	return distance;
-}
+		// Before the first column every row is 0 (the match may start anywhere).
+		const std::uint64_t zero = 0;
+		auto previousPv = column == 0 ? &zero : _pv.data() + (column - 1) * _nBlocks;
+		auto previousMv = column == 0 ? &zero : _mv.data() + (column - 1) * _nBlocks;
+		auto pv = _pv.data() + column * _nBlocks;
+		auto mv = _mv.data() + column * _nBlocks;
+		const std::size_t previousStep = column == 0 ? 0 : 1;
+
+		auto distance = std::numeric_limits<std::uint32_t>::max();
+
+		for (const auto& word : dataWords)
+		{
+			// Horizontal delta entering the block from above, the first row grows by one per column.
+			int hin = 1;
+
+			// Rows relative to the value at row 0 (the number of columns).
+			int rowValue = 0;
+			int minRowValue = 0;
+
+			for (std::size_t offset = 0; offset < word.size(); offset += 64)
+			{
+				const auto blockSize = std::min<std::size_t>(64, word.size() - offset);
+
+				std::uint64_t eq = 0;
+
+				for (std::size_t i = 0; i < blockSize; ++i)
+				{
+					eq |= std::uint64_t{ word[offset + i] == c } << i;
+				}
+
+				const auto xv = eq | *previousMv;
+
+				if (hin < 0)
+					eq |= 1;
+
+				const auto xh = (((eq & *previousPv) + *previousPv) ^ *previousPv) | eq;
+
+				auto ph = *previousMv | ~(xh | *previousPv);
+				auto mh = *previousPv & xh;
+
+				const int hout = (ph >> 63) ? 1 : (mh >> 63) ? -1 : 0;
+
+				ph <<= 1;
+				mh <<= 1;
+
+				if (hin < 0)
+					mh |= 1;
+				else if (hin > 0)
+					ph |= 1;
+
+				*pv = mh | ~(xv | ph);
+				*mv = ph & xv;
+
+				hin = hout;
+
+				// Walk the rows where the value changes, lowest first.
+				auto changes = (*pv | *mv) & (~std::uint64_t{ 0 } >> (64 - blockSize));
+
+				while (changes != 0)
+				{
+					const auto row = changes & (0 - changes);
+
+					if (*pv & row)
+					{
+						++rowValue;
+					}
+					else
+					{
+						minRowValue = std::min(minRowValue, --rowValue);
+					}
+
+					changes ^= row;
+				}
+
+				previousPv += previousStep;
+				previousMv += previousStep;
+				++pv;
+				++mv;
+			}
+
+			distance = std::min(distance, static_cast<std::uint32_t>(static_cast<int>(column + 1) + minRowValue));
+		}
+
+		_distances.push_back(distance);
+	}
+};
@@ -0,0 +1,120 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include <vector>
+
+// Open addressing (linear probing) hash map from an entry's unique id to its slot in the database.
+// Ids are only ever added, reordering the database means rebuilding the index.
+class EntryIndex
+{
+public:
+	static constexpr std::size_t npos = static_cast<std::size_t>(-1);
+
+private:
+	struct Bucket
+	{
+		std::uint64_t key;
+		std::size_t slot;
+	};
+
+	std::vector<Bucket> _buckets;
+	std::size_t _size = 0;
+
+public:
+	std::size_t size() const
+	{
+		return _size;
+	}
+
+	void clear()
+	{
+		_buckets.clear();
+		_size = 0;
+	}
+
+	void reserve(std::size_t n)
+	{
+		// Keeps the load factor at or below 1/2.
+		std::size_t capacity = 16;
+
+		while (capacity < n * 2)
+		{
+			capacity *= 2;
+		}
+
+		if (capacity > _buckets.size())
+		{
+			rehash(capacity);
+		}
+	}
+
+	// Returns false (and keeps the old slot) if the id is already known.
+	bool insert(std::uint64_t key, std::size_t slot)
+	{
+		reserve(_size + 1);
+
+		auto& bucket = probe(key);
+
+		if (bucket.slot != npos)
+		{
+			return false;
+		}
+
+		bucket.key = key;
+		bucket.slot = slot;
+		++_size;
+
+		return true;
+	}
+
+	std::size_t find(std::uint64_t key) const
+	{
+		if (_buckets.empty())
+		{
+			return npos;
+		}
+
+		return const_cast<EntryIndex*>(this)->probe(key).slot;
+	}
+
+private:
+	static std::uint64_t hash(std::uint64_t key)
+	{ // Ids imported from text can be anything, so mix them (splitmix64 finalizer).
+		key ^= key >> 30;
+		key *= 0xBF58476D1CE4E5B9ull;
+		key ^= key >> 27;
+		key *= 0x94D049BB133111EBull;
+		key ^= key >> 31;
+		return key;
+	}
+
+	// Returns the bucket holding key or the empty bucket where it would go.
+	Bucket& probe(std::uint64_t key)
+	{
+		const auto mask = _buckets.size() - 1;
+
+		for (auto i = static_cast<std::size_t>(hash(key)) & mask; ; i = (i + 1) & mask)
+		{
+			if (_buckets[i].slot == npos || _buckets[i].key == key)
+			{
+				return _buckets[i];
+			}
+		}
+	}
+
+	void rehash(std::size_t capacity)
+	{
+		std::vector<Bucket> buckets(capacity, Bucket{ 0, npos });
+		_buckets.swap(buckets);
+
+		for (auto& bucket : buckets)
+		{
+			if (bucket.slot != npos)
+			{
+				probe(bucket.key) = bucket;
+			}
+		}
+	}
+};
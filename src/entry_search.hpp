@@ -0,0 +1,522 @@
+#pragma once
+
+#include "edit_distance.hpp"
+#include "qgram_index.hpp"
+
+#include "utility/concurrent_queue.hpp"
+#include "utility/waitable_flag.hpp"
+
+#include <cstddef>
+#include <cstdint>
+
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <functional>
+#include <memory>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <vector>
+
+// Ranks entries by the wordBasedEditDistance() of their names to a search string.
+// Large searches are scored in chunks on a pool of worker threads while the caller
+// goes on, finish() then merges the best entries of every chunk. Workers only touch
+// the state kept here (copies of names and hide flags, incremental distances),
+// never the entries themselves, so those can be modified while a search runs.
+//
+// Very large databases keep a QGramIndex of the names. Entries sharing a trigram with
+// the query are scored first. If they alone decide the first page (every other entry
+// is provably further away), finish() can show that page before the rest is scored.
+class EntrySearch
+{
+public:
+	static constexpr std::size_t RANK_PAGE_SIZE = 64;
+	static constexpr std::size_t CHUNK_SIZE = 1024;
+	static constexpr std::size_t PARALLEL_THRESHOLD = 4096;
+	static constexpr std::size_t PREFILTER_THRESHOLD = 16384;
+
+private:
+	enum class Continuation : std::uint8_t
+	{
+		START_OVER,
+		EXTEND,
+		TRUNCATE,
+	};
+
+	struct RankOrder
+	{
+		const std::vector<std::uint8_t>& hide;
+		const std::vector<SearchWordCache>& names;
+		const std::vector<std::uint32_t>& distances;
+
+		bool operator () (std::size_t lhs, std::size_t rhs) const
+		{
+			// Hidden entries always have lower priority.
+			if (hide[lhs] != hide[rhs])
+				return hide[rhs] != 0;
+
+			if (distances[lhs] != distances[rhs])
+				return distances[lhs] < distances[rhs];
+
+			// If strings have the same distance, sort lexicographically
+			const auto& lhsName = names[lhs].source();
+			const auto& rhsName = names[rhs].source();
+
+			if (lhsName != rhsName)
+				return lhsName < rhsName;
+
+			return lhs < rhs;
+		}
+	};
+
+	struct Search
+	{
+		std::uint64_t id;
+		std::string query;
+		std::size_t finishedLength; // Query up to its last word
+		std::vector<LevenshteinPattern> finishedPatterns; // Words in front of the last one
+		std::vector<Continuation> continuations; // How to get from every query in _history to this one
+		std::vector<std::size_t> order; // Entry positions in the order they are scored, candidates first
+		std::vector<std::size_t> chunkBegins; // Into order, plus its end
+		std::size_t candidateChunks; // The first chunks, all candidates
+		std::uint32_t missingDistance; // Lower bound for entries that aren't candidates
+		std::vector<std::uint32_t> distances;
+		std::vector<std::vector<std::size_t>> chunkRanks; // Best RANK_PAGE_SIZE entries of every chunk, in order
+		std::vector<std::size_t> candidateRank; // Best RANK_PAGE_SIZE candidates, in order
+		bool candidatesDecide; // candidateRank is the first page
+		std::atomic_size_t remainingCandidateChunks;
+		std::atomic_size_t remainingChunks;
+		std::atomic_bool candidatesDone;
+		std::atomic_bool cancelled;
+		WaitableFlag done;
+		std::function<void()> onFinished;
+	};
+
+	// Per entry state by position, in separate arrays so that every step only touches what it needs.
+	std::vector<std::uint8_t> _hide;
+	std::vector<SearchWordCache> _names; // Copy of the name and its words
+	std::vector<IncrementalWordDistance> _states;
+	std::vector<std::uint64_t> _searchIds; // Search whose query the state belongs to, 0 if none
+	std::vector<std::uint32_t> _indexedGenerations; // Name generation in _index, 0 if none
+
+	std::shared_ptr<Search> _current;
+	std::uint64_t _lastId = 0;
+	std::uint64_t _finishedId = 0;
+	std::uint64_t _candidatesFinishedId = 0;
+
+	QGramIndex _index; // Only used from PREFILTER_THRESHOLD entries on
+	std::vector<std::uint64_t> _candidateMarks; // Id of the last search an entry was a candidate for
+
+	// Queries of the searches since the last finished one, entries can be at any of them.
+	std::vector<std::string> _history;
+	std::uint64_t _historyBase = 1; // Id of _history[0]
+
+	std::vector<std::uint32_t> _distances; // Of the last finished search
+	std::vector<std::size_t> _ranking; // Entry positions by rank
+	std::size_t _rankedCount = 0; // Entries in their final place, the rest is sorted when accessed
+
+	ConcurrentQueue<std::function<void()>> _tasks;
+	std::vector<std::thread> _workers;
+
+public:
+	~EntrySearch()
+	{
+		cancel();
+
+		for (std::size_t i = 0; i < _workers.size(); ++i)
+		{
+			_tasks.push(std::function<void()>());
+		}
+
+		for (auto& worker : _workers)
+		{
+			worker.join();
+		}
+	}
+
+	EntrySearch() {}
+	EntrySearch(const EntrySearch&) = delete;
+	EntrySearch& operator = (const EntrySearch&) = delete;
+
+	// Starts ranking entries (a random access container of anything with name and hide members)
+	// by their distance to query. A search that is still running is cancelled. onFinished is called
+	// from a worker thread (or from this function for small searches) once finish() will take the result.
+	template <typename Entries>
+	void start(const std::string& query, const Entries& entries, std::function<void()> onFinished)
+	{
+		cancel();
+
+		const auto nEntries = entries.size();
+		_hide.resize(nEntries);
+		_names.resize(nEntries);
+		_states.resize(nEntries);
+		_searchIds.resize(nEntries);
+		_indexedGenerations.resize(nEntries);
+
+		const bool prefilter = nEntries >= PREFILTER_THRESHOLD;
+
+		for (std::size_t i = 0; i < nEntries; ++i)
+		{
+			const auto& words = _names[i].words(entries[i].name.data(), entries[i].name.size());
+			_hide[i] = entries[i].hide;
+
+			if (prefilter && _indexedGenerations[i] != _names[i].generation())
+			{
+				_index.update(i, words);
+				_indexedGenerations[i] = _names[i].generation();
+			}
+		}
+
+		auto search = std::make_shared<Search>();
+		search->id = ++_lastId;
+		search->query = query;
+
+		const auto lastWord = std::find_if(query.rbegin(), query.rend(), [](char c) { return std::isspace(c); });
+		search->finishedLength = static_cast<std::size_t>(query.rend() - lastWord);
+		search->finishedPatterns = makeSearchPatterns(parseSearchWords(query.substr(0, search->finishedLength)));
+
+		for (const auto& previous : _history)
+		{
+			if (query.compare(0, previous.size(), previous) == 0)
+				search->continuations.push_back(Continuation::EXTEND);
+			else if (previous.compare(0, query.size(), query) == 0)
+				search->continuations.push_back(Continuation::TRUNCATE);
+			else
+				search->continuations.push_back(Continuation::START_OVER);
+		}
+
+		_history.push_back(query);
+
+		const auto queryWords = parseSearchWords(query);
+		search->missingDistance = QGramIndex::missingDistance(queryWords);
+		search->order.reserve(_hide.size());
+
+		if (prefilter && search->missingDistance > 0)
+		{
+			_candidateMarks.resize(_hide.size());
+
+			_index.forEachCandidate(queryWords, [&](std::size_t position) {
+				if (_candidateMarks[position] != search->id)
+				{
+					_candidateMarks[position] = search->id;
+					search->order.push_back(position);
+				}
+			});
+		}
+
+		const auto nCandidates = search->order.size();
+
+		for (std::size_t i = 0; i < _hide.size(); ++i)
+		{
+			if (nCandidates == 0 || _candidateMarks[i] != search->id)
+			{
+				search->order.push_back(i);
+			}
+		}
+
+		// Candidates and the others are chunked separately.
+		for (std::size_t i = 0; i < nCandidates; i += CHUNK_SIZE)
+		{
+			search->chunkBegins.push_back(i);
+		}
+
+		search->candidateChunks = search->chunkBegins.size();
+
+		for (std::size_t i = nCandidates; i < _hide.size(); i += CHUNK_SIZE)
+		{
+			search->chunkBegins.push_back(i);
+		}
+
+		const auto nChunks = search->chunkBegins.size();
+		search->chunkBegins.push_back(_hide.size());
+
+		search->distances.resize(_hide.size());
+		search->chunkRanks.resize(nChunks);
+		search->candidatesDecide = false;
+		search->remainingCandidateChunks = search->candidateChunks;
+		search->remainingChunks = nChunks;
+		search->candidatesDone = false;
+		search->cancelled = false;
+		search->onFinished = std::move(onFinished);
+
+		_current = search;
+
+		if (_hide.size() >= PARALLEL_THRESHOLD)
+		{
+			startWorkers();
+		}
+
+		if (_hide.size() < PARALLEL_THRESHOLD || _workers.empty())
+		{
+			for (std::size_t chunk = 0; chunk < nChunks; ++chunk)
+			{
+				scoreChunk(*search, chunk);
+				chunkDone(*search, chunk);
+			}
+
+			if (nChunks == 0)
+			{
+				complete(*search);
+			}
+		}
+		else
+		{
+			for (std::size_t chunk = 0; chunk < nChunks; ++chunk)
+			{
+				_tasks.push([this, search, chunk] {
+					scoreChunk(*search, chunk);
+					chunkDone(*search, chunk);
+				});
+			}
+		}
+	}
+
+	// Takes the result of the last started search, returns false if there is nothing new to take.
+	// That can be the first page while the rest is still being scored, then the whole ranking.
+	bool finish()
+	{
+		if (_current == nullptr || _current->cancelled)
+		{
+			return false;
+		}
+
+		auto& search = *_current;
+
+		if (!search.done.isSet())
+		{
+			if (!search.candidatesDone || !search.candidatesDecide || _candidatesFinishedId == search.id)
+			{
+				return false;
+			}
+
+			// The other entries follow in the order they were added, until they are scored. Hidden ones
+			// still go last like in RankOrder, the list leaves them out and maps its rows to ranks.
+			std::vector<bool> ranked(_hide.size());
+			_ranking = search.candidateRank;
+
+			for (auto position : _ranking)
+			{
+				ranked[position] = true;
+			}
+
+			for (std::uint8_t hidden = 0; hidden <= 1; ++hidden)
+			{
+				for (std::size_t i = 0; i < _hide.size(); ++i)
+				{
+					if (!ranked[i] && (_hide[i] != 0) == (hidden != 0))
+					{
+						_ranking.push_back(i);
+					}
+				}
+			}
+
+			_rankedCount = _ranking.size();
+			_candidatesFinishedId = search.id;
+
+			return true;
+		}
+
+		if (_finishedId == search.id)
+		{
+			return false;
+		}
+
+		_distances.swap(search.distances);
+
+		// The best entries overall are among the best of every chunk.
+		std::vector<std::size_t> best;
+
+		for (const auto& chunkRank : search.chunkRanks)
+		{
+			best.insert(best.end(), chunkRank.begin(), chunkRank.end());
+		}
+
+		const auto count = std::min(RANK_PAGE_SIZE, best.size());
+		std::partial_sort(best.begin(), best.begin() + count, best.end(), RankOrder{ _hide, _names, _distances });
+		best.resize(count);
+
+		std::vector<bool> ranked(_hide.size());
+		_ranking = best;
+
+		for (auto position : best)
+		{
+			ranked[position] = true;
+		}
+
+		for (std::size_t i = 0; i < _hide.size(); ++i)
+		{
+			if (!ranked[i])
+			{
+				_ranking.push_back(i);
+			}
+		}
+
+		_rankedCount = count;
+
+		// Every entry is at this search now.
+		_history.assign(1, search.query);
+		_historyBase = search.id;
+		_finishedId = search.id;
+
+		return true;
+	}
+
+	// Starts a search and waits for it.
+	template <typename Entries>
+	void run(const std::string& query, const Entries& entries)
+	{
+		start(query, entries, nullptr);
+		_current->done.wait();
+		finish();
+	}
+
+	// Position of the entry at rank, for entries added after the last finished search that's rank itself.
+	std::size_t position(std::size_t rank)
+	{
+		if (rank >= _ranking.size())
+		{
+			return rank;
+		}
+
+		rankUntil(rank + 1);
+		return _ranking[rank];
+	}
+
+private:
+	void startWorkers()
+	{
+		if (_workers.empty())
+		{
+			const auto nThreads = std::max(1u, std::thread::hardware_concurrency());
+
+			for (unsigned i = 0; i < nThreads; ++i)
+			{
+				try
+				{
+					_workers.emplace_back([this] {
+						for (auto task = _tasks.pop(); task; task = _tasks.pop())
+						{
+							task();
+						}
+					});
+				}
+				catch (std::system_error&)
+				{ // Fewer workers (or none, then searches run on the calling thread).
+					break;
+				}
+			}
+		}
+	}
+
+	void cancel()
+	{
+		if (_current != nullptr)
+		{
+			_current->cancelled = true;
+			_current->done.wait();
+		}
+	}
+
+	void chunkDone(Search& search, std::size_t chunk)
+	{
+		if (chunk < search.candidateChunks && --search.remainingCandidateChunks == 0)
+		{
+			auto& best = search.candidateRank;
+
+			for (std::size_t i = 0; i < search.candidateChunks; ++i)
+			{
+				best.insert(best.end(), search.chunkRanks[i].begin(), search.chunkRanks[i].end());
+			}
+
+			const auto count = std::min(RANK_PAGE_SIZE, best.size());
+			std::partial_sort(best.begin(), best.begin() + count, best.end(), RankOrder{ _hide, _names, search.distances });
+			best.resize(count);
+
+			// Entries that aren't candidates are at least missingDistance away, and only visible entries rank before them.
+			search.candidatesDecide = !search.cancelled && count == RANK_PAGE_SIZE && !_hide[best.back()]
+				&& search.distances[best.back()] < search.missingDistance;
+			search.candidatesDone = true;
+
+			if (search.candidatesDecide && search.onFinished)
+			{
+				search.onFinished();
+			}
+		}
+
+		if (--search.remainingChunks == 0)
+		{
+			complete(search);
+		}
+	}
+
+	void complete(Search& search)
+	{
+		search.done.set();
+
+		if (!search.cancelled && search.onFinished)
+		{
+			search.onFinished();
+		}
+	}
+
+	void scoreChunk(Search& search, std::size_t chunk)
+	{
+		const auto begin = search.order.begin() + search.chunkBegins[chunk];
+		const auto end = search.order.begin() + search.chunkBegins[chunk + 1];
+
+		for (auto it = begin; it != end; ++it)
+		{
+			if (search.cancelled)
+			{ // Entries that were scored are at this search, the others still at theirs.
+				return;
+			}
+
+			const auto i = *it;
+			const auto& words = _names[i].words();
+			const auto generation = _names[i].generation();
+			auto& state = _states[i];
+
+			const bool known = _searchIds[i] >= _historyBase && _searchIds[i] < search.id;
+			const auto continuation = known ? search.continuations[_searchIds[i] - _historyBase] : Continuation::START_OVER;
+			const auto previousLength = known ? _history[_searchIds[i] - _historyBase].size() : 0;
+
+			if (continuation == Continuation::START_OVER
+				|| !state.continues(generation, previousLength)
+				|| (continuation == Continuation::TRUNCATE && !state.truncate(search.query.size())))
+			{
+				state.reset(generation, wordBasedEditDistance(search.finishedPatterns, words), search.finishedLength);
+			}
+
+			state.extend(search.query, words);
+			_searchIds[i] = search.id;
+			search.distances[i] = state.distance();
+		}
+
+		auto& chunkRank = search.chunkRanks[chunk];
+		chunkRank.assign(begin, end);
+
+		const auto count = std::min(RANK_PAGE_SIZE, chunkRank.size());
+		std::partial_sort(chunkRank.begin(), chunkRank.begin() + count,
+			chunkRank.end(), RankOrder{ _hide, _names, search.distances });
+		chunkRank.resize(count);
+	}
+
+	// Sorts the ranking until at least count entries are in their final place.
+	// Pages grow with the sorted part, so walking all entries costs about as much as one full sort.
+	void rankUntil(std::size_t count)
+	{
+		if (count <= _rankedCount || _rankedCount >= _ranking.size())
+		{
+			return;
+		}
+
+		const auto newCount = std::min(_ranking.size(),
+			std::max(count, _rankedCount + std::max(RANK_PAGE_SIZE, _rankedCount)));
+
+		std::partial_sort(_ranking.begin() + _rankedCount, _ranking.begin() + newCount,
+			_ranking.end(), RankOrder{ _hide, _names, _distances });
+
+		_rankedCount = newCount;
+	}
+};
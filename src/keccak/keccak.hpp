@@ -44,6 +44,67 @@ namespace keccak
 	typedef detail::basic_hasher<192, 192, 15> shake192_hasher;
 	typedef detail::basic_hasher<256, 256, 15> shake256_hasher;
 
+	/* Interface: 
+	 * static constexpr std::size_t collision_resistance;
+	 * static constexpr std::size_t preimage_resistance;
+	 * static constexpr std::size_t messages;
+	 * static constexpr std::size_t capacity;
+	 * static constexpr std::size_t hash_size;
+	 * typedef std::array<std::uint8_t, hash_size> hash_type;
+	 * 
+	 * void update(std::array<const void*, N> data, std::array<std::size_t, N> sizes);
+	 * void update(const std::array<const void*, N>& data, std::size_t size);
+	 * void finish(std::array<void*, N> buffers, std::size_t size);
+	 * std::array<hash_type, N> finish();
+	 * 
+	 * ---- ---- ---- ---- ---- ---- ---- ---- 
+	 * 
+	 * multi_hasher<x, y>
+	 * x = single message hasher (e.g. shake256_hasher)
+	 * y = number of messages
+	 * 
+	 * Produces the same hashes as N separate hashers, but permutes up to four
+	 * states at once. Messages of equal length get the most out of it.
+	 */
+
+	template <typename Hasher, std::size_t N>
+	using multi_hasher = detail::basic_multi_hasher<Hasher::collision_resistance,
+		Hasher::preimage_resistance, Hasher::hash_domain, N>;
+
+	/* Interface: 
+	 * static constexpr std::size_t collision_resistance;
+	 * static constexpr std::size_t preimage_resistance;
+	 * static constexpr std::size_t leaf_size;
+	 * static constexpr std::size_t capacity;
+	 * static constexpr std::size_t hash_size;
+	 * typedef std::array<std::uint8_t, hash_size> hash_type;
+	 * 
+	 * basic_tree_hasher(std::size_t threads = 1);
+	 * basic_tree_hasher(const void* data, std::size_t size, std::size_t threads = 1);
+	 * void update(const void* data, std::size_t size);
+	 * void defer_first_leaf();
+	 * void finish_first_leaf(const void* data, std::size_t size);
+	 * void finish(void* buf, std::size_t size);
+	 * hash_type finish();
+	 * 
+	 * ---- ---- ---- ---- ---- ---- ---- ---- 
+	 * 
+	 * detail::basic_tree_hasher<x, y, z, w>
+	 * x = collision resistance
+	 * y = preimage resistance
+	 * z = domain of the final hash
+	 * w = leaf size in bytes
+	 * 
+	 * hash = h(leaf_hash(leaf 0) || ... || leaf_hash(leaf n - 1) || uint64_t(message size))
+	 * Only the last leaf may be shorter than w. Leaves are hashed four at a time, those
+	 * passed to one update() on up to threads threads, so the hash is not compatible
+	 * with the plain hasher of the same parameters.
+	 * After defer_first_leaf() updates start at the second leaf, the first one is
+	 * passed to finish_first_leaf() before finish().
+	 */
+
+	typedef detail::basic_tree_hasher<128, 256, 2, 8192> tree_hasher_256;
+
 	/* Interface: 
 	 * static constexpr std::size_t security_strength;
 	 * static constexpr std::size_t capacity;
@@ -53,6 +114,13 @@ namespace keccak
 	 * 		void* buffer, const void* body, std::size_t body_and_buffer_size,
 	 * 		void* tag, std::size_t tag_size);
 	 * 
+	 * The same in parts, for bodies that arrive in chunks (buffer may equal body):
+	 * void begin(const void* header, std::size_t header_size);
+	 * void transform(void* buffer, const void* body, std::size_t size);
+	 * void finish(void* tag, std::size_t tag_size);
+	 * 
+	 * A cipher object handles one message.
+	 * 
 	 * ---- ---- ---- ---- ---- ---- ---- ---- 
 	 * 
 	 * detail::basic_authenticated_cipher<x, y>
@@ -63,7 +131,7 @@ namespace keccak
 	typedef detail::basic_authenticated_cipher<128, detail::cipher_mode::encrypt> authenticated_encrypter_128;
 	typedef detail::basic_authenticated_cipher<128, detail::cipher_mode::decrypt> authenticated_decrypter_128;
 	typedef detail::basic_authenticated_cipher<256, detail::cipher_mode::encrypt> authenticated_encrypter_256;
-	typedef detail::basic_authenticated_cipher<256, detail::cipher_mode::encrypt> authenticated_decrypter_256;
+	typedef detail::basic_authenticated_cipher<256, detail::cipher_mode::decrypt> authenticated_decrypter_256;
 
 	/* Interface: 
 	 * typedef UIntType result_type;
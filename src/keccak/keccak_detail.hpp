@@ -5,8 +5,29 @@
 #include <cstdint>
 #include <cstring>
 
+#include <algorithm>
 #include <array>
 #include <limits>
+#include <thread>
+#include <vector>
+
+// The AVX2 permutation is compiled regardless of the target architecture flags and selected
+// at runtime, unless AVX2 is enabled at compile time anyway.
+#if defined(__SSE2__) || (defined(_MSC_VER) && (defined(_M_X64) || _M_IX86_FP == 2))
+#define KECCAK_AVX2_AVAILABLE
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
+#endif
+
+#if defined(_MSC_VER) && !defined(__clang__)
+#define KECCAK_TARGET(isa)
+#else
+#define KECCAK_TARGET(isa) __attribute__((target(isa)))
+#endif
 
 namespace keccak
 {
@@ -150,108 +171,573 @@ namespace keccak
 			0x8000000080008008ull,
 		};
 
-		// Keccak round function
-
-		void round(state_type& s, lane_type round_constant)
-		{
-			auto c0 = s[0][0] ^ s[1][0] ^ s[2][0] ^ s[3][0] ^ s[4][0];
-			auto c1 = s[0][1] ^ s[1][1] ^ s[2][1] ^ s[3][1] ^ s[4][1];
-			auto c2 = s[0][2] ^ s[1][2] ^ s[2][2] ^ s[3][2] ^ s[4][2];
-			auto c3 = s[0][3] ^ s[1][3] ^ s[2][3] ^ s[3][3] ^ s[4][3];
-			auto c4 = s[0][4] ^ s[1][4] ^ s[2][4] ^ s[3][4] ^ s[4][4];
-
-			auto d0 = c4 ^ rol(c1, 1);
-			auto d1 = c0 ^ rol(c2, 1);
-			auto d2 = c1 ^ rol(c3, 1);
-			auto d3 = c2 ^ rol(c4, 1);
-			auto d4 = c3 ^ rol(c0, 1);
-
-			s[0][0] ^= d0;
-			s[0][1] ^= d1;
-			s[0][2] ^= d2;
-			s[0][3] ^= d3;
-			s[0][4] ^= d4;
-			s[1][0] ^= d0;
-			s[1][1] ^= d1;
-			s[1][2] ^= d2;
-			s[1][3] ^= d3;
-			s[1][4] ^= d4;
-			s[2][0] ^= d0;
-			s[2][1] ^= d1;
-			s[2][2] ^= d2;
-			s[2][3] ^= d3;
-			s[2][4] ^= d4;
-			s[3][0] ^= d0;
-			s[3][1] ^= d1;
-			s[3][2] ^= d2;
-			s[3][3] ^= d3;
-			s[3][4] ^= d4;
-			s[4][0] ^= d0;
-			s[4][1] ^= d1;
-			s[4][2] ^= d2;
-			s[4][3] ^= d3;
-			s[4][4] ^= d4;
-
-			auto s00 = rol(s[0][0], rotation_offsets[0][0]);
-			auto s20 = rol(s[0][1], rotation_offsets[0][1]);
-			auto s40 = rol(s[0][2], rotation_offsets[0][2]);
-			auto s10 = rol(s[0][3], rotation_offsets[0][3]);
-			auto s30 = rol(s[0][4], rotation_offsets[0][4]);
-			auto s31 = rol(s[1][0], rotation_offsets[1][0]);
-			auto s01 = rol(s[1][1], rotation_offsets[1][1]);
-			auto s21 = rol(s[1][2], rotation_offsets[1][2]);
-			auto s41 = rol(s[1][3], rotation_offsets[1][3]);
-			auto s11 = rol(s[1][4], rotation_offsets[1][4]);
-			auto s12 = rol(s[2][0], rotation_offsets[2][0]);
-			auto s32 = rol(s[2][1], rotation_offsets[2][1]);
-			auto s02 = rol(s[2][2], rotation_offsets[2][2]);
-			auto s22 = rol(s[2][3], rotation_offsets[2][3]);
-			auto s42 = rol(s[2][4], rotation_offsets[2][4]);
-			auto s43 = rol(s[3][0], rotation_offsets[3][0]);
-			auto s13 = rol(s[3][1], rotation_offsets[3][1]);
-			auto s33 = rol(s[3][2], rotation_offsets[3][2]);
-			auto s03 = rol(s[3][3], rotation_offsets[3][3]);
-			auto s23 = rol(s[3][4], rotation_offsets[3][4]);
-			auto s24 = rol(s[4][0], rotation_offsets[4][0]);
-			auto s44 = rol(s[4][1], rotation_offsets[4][1]);
-			auto s14 = rol(s[4][2], rotation_offsets[4][2]);
-			auto s34 = rol(s[4][3], rotation_offsets[4][3]);
-			auto s04 = rol(s[4][4], rotation_offsets[4][4]);
-
-			s[0][0] = s00 ^ (~s01 & s02);
-			s[0][1] = s01 ^ (~s02 & s03);
-			s[0][2] = s02 ^ (~s03 & s04);
-			s[0][3] = s03 ^ (~s04 & s00);
-			s[0][4] = s04 ^ (~s00 & s01);
-			s[1][0] = s10 ^ (~s11 & s12);
-			s[1][1] = s11 ^ (~s12 & s13);
-			s[1][2] = s12 ^ (~s13 & s14);
-			s[1][3] = s13 ^ (~s14 & s10);
-			s[1][4] = s14 ^ (~s10 & s11);
-			s[2][0] = s20 ^ (~s21 & s22);
-			s[2][1] = s21 ^ (~s22 & s23);
-			s[2][2] = s22 ^ (~s23 & s24);
-			s[2][3] = s23 ^ (~s24 & s20);
-			s[2][4] = s24 ^ (~s20 & s21);
-			s[3][0] = s30 ^ (~s31 & s32);
-			s[3][1] = s31 ^ (~s32 & s33);
-			s[3][2] = s32 ^ (~s33 & s34);
-			s[3][3] = s33 ^ (~s34 & s30);
-			s[3][4] = s34 ^ (~s30 & s31);
-			s[4][0] = s40 ^ (~s41 & s42);
-			s[4][1] = s41 ^ (~s42 & s43);
-			s[4][2] = s42 ^ (~s43 & s44);
-			s[4][3] = s43 ^ (~s44 & s40);
-			s[4][4] = s44 ^ (~s40 & s41);
-
-			s[0][0] ^= round_constant;
+		// Keccak-f permutation
+		// 
+		// The state is held in local variables, which the compiler can keep in registers for
+		// all rounds. The lanes [0][1], [0][2], [1][3], [2][2], [3][2] and [4][0] are stored
+		// inverted while the rounds run. That way chi needs one not per row instead of five.
+
+		void keccak_f_scalar(state_type& s)
+		{
+			auto a00 = s[0][0], a01 = s[0][1], a02 = s[0][2], a03 = s[0][3], a04 = s[0][4];
+			auto a10 = s[1][0], a11 = s[1][1], a12 = s[1][2], a13 = s[1][3], a14 = s[1][4];
+			auto a20 = s[2][0], a21 = s[2][1], a22 = s[2][2], a23 = s[2][3], a24 = s[2][4];
+			auto a30 = s[3][0], a31 = s[3][1], a32 = s[3][2], a33 = s[3][3], a34 = s[3][4];
+			auto a40 = s[4][0], a41 = s[4][1], a42 = s[4][2], a43 = s[4][3], a44 = s[4][4];
+
+			a01 = ~a01;
+			a02 = ~a02;
+			a13 = ~a13;
+			a22 = ~a22;
+			a32 = ~a32;
+			a40 = ~a40;
+
+			for (std::size_t i = 0; i < round_constants.size(); ++i)
+			{
+				const auto c0 = a00 ^ a10 ^ a20 ^ a30 ^ a40;
+				const auto c1 = a01 ^ a11 ^ a21 ^ a31 ^ a41;
+				const auto c2 = a02 ^ a12 ^ a22 ^ a32 ^ a42;
+				const auto c3 = a03 ^ a13 ^ a23 ^ a33 ^ a43;
+				const auto c4 = a04 ^ a14 ^ a24 ^ a34 ^ a44;
+
+				const auto d0 = c4 ^ rol(c1, 1);
+				const auto d1 = c0 ^ rol(c2, 1);
+				const auto d2 = c1 ^ rol(c3, 1);
+				const auto d3 = c2 ^ rol(c4, 1);
+				const auto d4 = c3 ^ rol(c0, 1);
+
+				// Theta, rho and pi, b is indexed by the position after pi.
+				const auto b00 = a00 ^ d0;
+				const auto b01 = rol(a11 ^ d1, rotation_offsets[1][1]);
+				const auto b02 = rol(a22 ^ d2, rotation_offsets[2][2]);
+				const auto b03 = rol(a33 ^ d3, rotation_offsets[3][3]);
+				const auto b04 = rol(a44 ^ d4, rotation_offsets[4][4]);
+
+				const auto b10 = rol(a03 ^ d3, rotation_offsets[0][3]);
+				const auto b11 = rol(a14 ^ d4, rotation_offsets[1][4]);
+				const auto b12 = rol(a20 ^ d0, rotation_offsets[2][0]);
+				const auto b13 = rol(a31 ^ d1, rotation_offsets[3][1]);
+				const auto b14 = rol(a42 ^ d2, rotation_offsets[4][2]);
+
+				const auto b20 = rol(a01 ^ d1, rotation_offsets[0][1]);
+				const auto b21 = rol(a12 ^ d2, rotation_offsets[1][2]);
+				const auto b22 = rol(a23 ^ d3, rotation_offsets[2][3]);
+				const auto b23 = rol(a34 ^ d4, rotation_offsets[3][4]);
+				const auto b24 = rol(a40 ^ d0, rotation_offsets[4][0]);
+
+				const auto b30 = rol(a04 ^ d4, rotation_offsets[0][4]);
+				const auto b31 = rol(a10 ^ d0, rotation_offsets[1][0]);
+				const auto b32 = rol(a21 ^ d1, rotation_offsets[2][1]);
+				const auto b33 = rol(a32 ^ d2, rotation_offsets[3][2]);
+				const auto b34 = rol(a43 ^ d3, rotation_offsets[4][3]);
+
+				const auto b40 = rol(a02 ^ d2, rotation_offsets[0][2]);
+				const auto b41 = rol(a13 ^ d3, rotation_offsets[1][3]);
+				const auto b42 = rol(a24 ^ d4, rotation_offsets[2][4]);
+				const auto b43 = rol(a30 ^ d0, rotation_offsets[3][0]);
+				const auto b44 = rol(a41 ^ d1, rotation_offsets[4][1]);
+
+				// Chi and iota
+				a00 = b00 ^ (b01 | b02) ^ round_constants[i];
+				a01 = b01 ^ (~b02 | b03);
+				a02 = b02 ^ (b03 & b04);
+				a03 = b03 ^ (b04 | b00);
+				a04 = b04 ^ (b00 & b01);
+
+				a10 = b10 ^ (b11 | b12);
+				a11 = b11 ^ (b12 & b13);
+				a12 = b12 ^ (b13 | ~b14);
+				a13 = b13 ^ (b14 | b10);
+				a14 = b14 ^ (b10 & b11);
+
+				a20 = b20 ^ (b21 | b22);
+				a21 = b21 ^ (b22 & b23);
+				a22 = b22 ^ (~b23 & b24);
+				a23 = ~b23 ^ (b24 | b20);
+				a24 = b24 ^ (b20 & b21);
+
+				a30 = b30 ^ (b31 & b32);
+				a31 = b31 ^ (b32 | b33);
+				a32 = b32 ^ (~b33 | b34);
+				a33 = ~b33 ^ (b34 & b30);
+				a34 = b34 ^ (b30 | b31);
+
+				a40 = b40 ^ (~b41 & b42);
+				a41 = ~b41 ^ (b42 | b43);
+				a42 = b42 ^ (b43 & b44);
+				a43 = b43 ^ (b44 | b40);
+				a44 = b44 ^ (b40 & b41);
+			}
+
+			a01 = ~a01;
+			a02 = ~a02;
+			a13 = ~a13;
+			a22 = ~a22;
+			a32 = ~a32;
+			a40 = ~a40;
+
+			s[0][0] = a00;
+			s[0][1] = a01;
+			s[0][2] = a02;
+			s[0][3] = a03;
+			s[0][4] = a04;
+			s[1][0] = a10;
+			s[1][1] = a11;
+			s[1][2] = a12;
+			s[1][3] = a13;
+			s[1][4] = a14;
+			s[2][0] = a20;
+			s[2][1] = a21;
+			s[2][2] = a22;
+			s[2][3] = a23;
+			s[2][4] = a24;
+			s[3][0] = a30;
+			s[3][1] = a31;
+			s[3][2] = a32;
+			s[3][3] = a33;
+			s[3][4] = a34;
+			s[4][0] = a40;
+			s[4][1] = a41;
+			s[4][2] = a42;
+			s[4][3] = a43;
+			s[4][4] = a44;
 		}
 
-		void keccak_f(state_type& s)
+		// Runtime CPU feature detection
+
+#if defined(KECCAK_AVX2_AVAILABLE)
+		inline bool detect_avx2()
+		{
+#if defined(__AVX2__)
+			return true;
+#else
+			std::uint32_t regs[4];
+
+#if defined(_MSC_VER)
+			const auto cpuid = [&](std::uint32_t leaf)
+			{
+				int info[4];
+				__cpuidex(info, static_cast<int>(leaf), 0);
+				std::memcpy(regs, info, sizeof regs);
+			};
+#else
+			const auto cpuid = [&](std::uint32_t leaf)
+			{
+				__cpuid_count(leaf, 0, regs[0], regs[1], regs[2], regs[3]);
+			};
+#endif
+
+			cpuid(0);
+
+			if (regs[0] < 7)
+			{
+				return false;
+			}
+
+			cpuid(1);
+
+			// The OS has to save the ymm registers on context switches.
+			if ((regs[2] & (1u << 27)) == 0 || (regs[2] & (1u << 28)) == 0)
+			{
+				return false;
+			}
+
+#if defined(_MSC_VER)
+			const auto xcr0 = _xgetbv(0);
+#else
+			std::uint32_t lo;
+			std::uint32_t hi;
+			__asm__ __volatile__("xgetbv" : "=a"(lo), "=d"(hi) : "c"(0));
+			const auto xcr0 = static_cast<std::uint64_t>(hi) << 32 | lo;
+#endif
+
+			cpuid(7);
+			return (xcr0 & 0x06) == 0x06 && (regs[1] & (1u << 5)) != 0;
+#endif
+		}
+
+		inline bool has_avx2()
+		{
+			static const bool avx2 = detect_avx2();
+			return avx2;
+		}
+
+		// AVX2 implementation
+		// 
+		// [0][0] is held in all four lanes of a00, the other 24 lanes are spread over six
+		// registers in an order where pi only has to permute within registers:
+		// 
+		//   a01 = [0][1] [0][2] [0][3] [0][4]
+		//   a20 = [2][0] [4][0] [1][0] [3][0]
+		//   a31 = [3][1] [1][2] [4][3] [2][4]
+		//   a21 = [2][1] [4][2] [1][3] [3][4]
+		//   a41 = [4][1] [3][2] [2][3] [1][4]
+		//   a11 = [1][1] [2][2] [3][3] [4][4]
+		// 
+		// (lane 0 first). Lane i of every register but a20 is in column i + 1, so theta
+		// works on whole registers. For chi, the neighbours of each lane in its row get
+		// gathered with blends and a permute.
+
+		KECCAK_TARGET("avx2") inline __m256i rolv_256(__m256i v0, __m256i left, __m256i right)
+		{
+			return _mm256_or_si256(_mm256_sllv_epi64(v0, left), _mm256_srlv_epi64(v0, right));
+		}
+
+		KECCAK_TARGET("avx2") inline __m256i rol1_256(__m256i v0)
+		{
+			return _mm256_or_si256(_mm256_slli_epi64(v0, 1), _mm256_srli_epi64(v0, 63));
+		}
+
+		// Takes lane i from vi.
+		KECCAK_TARGET("avx2") inline __m256i blend_256(__m256i v0, __m256i v1, __m256i v2, __m256i v3)
+		{
+			return _mm256_blend_epi32(_mm256_blend_epi32(v0, v1, 0x0C), _mm256_blend_epi32(v2, v3, 0xC0), 0xF0);
+		}
+
+		KECCAK_TARGET("avx2") inline __m256i set_lanes_256(lane_type l0, lane_type l1, lane_type l2, lane_type l3)
+		{
+			return _mm256_set_epi64x(static_cast<long long>(l3), static_cast<long long>(l2),
+				static_cast<long long>(l1), static_cast<long long>(l0));
+		}
+
+		KECCAK_TARGET("avx2") inline void get_lanes_256(__m256i v0, lane_type& l0, lane_type& l1, lane_type& l2, lane_type& l3)
+		{
+			alignas(32) std::array<lane_type, 4> lanes;
+			_mm256_store_si256(reinterpret_cast<__m256i*>(lanes.data()), v0);
+
+			l0 = lanes[0];
+			l1 = lanes[1];
+			l2 = lanes[2];
+			l3 = lanes[3];
+		}
+
+		KECCAK_TARGET("avx2") void keccak_f_avx2(state_type& s)
 		{
+			const auto& r = rotation_offsets;
+
+			const auto rho_left_01 = set_lanes_256(r[0][1], r[0][2], r[0][3], r[0][4]);
+			const auto rho_left_20 = set_lanes_256(r[2][0], r[4][0], r[1][0], r[3][0]);
+			const auto rho_left_31 = set_lanes_256(r[3][1], r[1][2], r[4][3], r[2][4]);
+			const auto rho_left_21 = set_lanes_256(r[2][1], r[4][2], r[1][3], r[3][4]);
+			const auto rho_left_41 = set_lanes_256(r[4][1], r[3][2], r[2][3], r[1][4]);
+			const auto rho_left_11 = set_lanes_256(r[1][1], r[2][2], r[3][3], r[4][4]);
+
+			const auto width = _mm256_set1_epi64x(64);
+			const auto rho_right_01 = _mm256_sub_epi64(width, rho_left_01);
+			const auto rho_right_20 = _mm256_sub_epi64(width, rho_left_20);
+			const auto rho_right_31 = _mm256_sub_epi64(width, rho_left_31);
+			const auto rho_right_21 = _mm256_sub_epi64(width, rho_left_21);
+			const auto rho_right_41 = _mm256_sub_epi64(width, rho_left_41);
+			const auto rho_right_11 = _mm256_sub_epi64(width, rho_left_11);
+
+			auto a00 = _mm256_set1_epi64x(static_cast<long long>(s[0][0]));
+			auto a01 = set_lanes_256(s[0][1], s[0][2], s[0][3], s[0][4]);
+			auto a20 = set_lanes_256(s[2][0], s[4][0], s[1][0], s[3][0]);
+			auto a31 = set_lanes_256(s[3][1], s[1][2], s[4][3], s[2][4]);
+			auto a21 = set_lanes_256(s[2][1], s[4][2], s[1][3], s[3][4]);
+			auto a41 = set_lanes_256(s[4][1], s[3][2], s[2][3], s[1][4]);
+			auto a11 = set_lanes_256(s[1][1], s[2][2], s[3][3], s[4][4]);
+
 			for (std::size_t i = 0; i < round_constants.size(); ++i)
 			{
-				round(s, round_constants[i]);
+				// Theta, c14 holds columns 1 to 4, c00 column 0 in all lanes.
+				const auto c14 = _mm256_xor_si256(_mm256_xor_si256(_mm256_xor_si256(a01, a31),
+					_mm256_xor_si256(a21, a41)), a11);
+
+				auto c00 = _mm256_xor_si256(a20, _mm256_permute4x64_epi64(a20, 0x4E));
+				c00 = _mm256_xor_si256(c00, _mm256_shuffle_epi32(c00, 0x4E));
+				c00 = _mm256_xor_si256(c00, a00);
+
+				const auto r14 = rol1_256(c14);
+				const auto d14 = _mm256_xor_si256(
+					_mm256_blend_epi32(_mm256_permute4x64_epi64(c14, 0x93), c00, 0x03),
+					_mm256_blend_epi32(_mm256_permute4x64_epi64(r14, 0x39), rol1_256(c00), 0xC0));
+				const auto d00 = _mm256_xor_si256(_mm256_permute4x64_epi64(c14, 0xFF), _mm256_permute4x64_epi64(r14, 0x00));
+
+				a00 = _mm256_xor_si256(a00, d00);
+				a20 = _mm256_xor_si256(a20, d00);
+				a01 = _mm256_xor_si256(a01, d14);
+				a31 = _mm256_xor_si256(a31, d14);
+				a21 = _mm256_xor_si256(a21, d14);
+				a41 = _mm256_xor_si256(a41, d14);
+				a11 = _mm256_xor_si256(a11, d14);
+
+				// Rho and pi
+				const auto b20 = rolv_256(a01, rho_left_01, rho_right_01);
+				const auto b31 = _mm256_permute4x64_epi64(rolv_256(a20, rho_left_20, rho_right_20), 0x72);
+				const auto b21 = _mm256_permute4x64_epi64(rolv_256(a31, rho_left_31, rho_right_31), 0x8D);
+				const auto b41 = _mm256_permute4x64_epi64(rolv_256(a21, rho_left_21, rho_right_21), 0x72);
+				const auto b11 = _mm256_permute4x64_epi64(rolv_256(a41, rho_left_41, rho_right_41), 0x1B);
+				const auto b01 = rolv_256(a11, rho_left_11, rho_right_11);
+
+				// Chi, nxx1 and nxx2 hold the lanes one and two columns to the right.
+				const auto p21 = _mm256_permute4x64_epi64(b20, 0x0B);
+				const auto p41 = _mm256_permute4x64_epi64(b20, 0x02);
+				const auto p11 = _mm256_permute4x64_epi64(b20, 0x0D);
+
+				const auto n001 = _mm256_permute4x64_epi64(b01, 0x00);
+				const auto n002 = _mm256_permute4x64_epi64(b01, 0x55);
+				const auto n011 = _mm256_blend_epi32(_mm256_permute4x64_epi64(b01, 0xF9), a00, 0xC0);
+				const auto n012 = _mm256_blend_epi32(_mm256_permute4x64_epi64(b01, 0x0E), a00, 0x30);
+				const auto n201 = _mm256_permute2x128_si256(_mm256_unpacklo_epi64(b21, b41), _mm256_unpacklo_epi64(b11, b31), 0x20);
+				const auto n202 = _mm256_permute2x128_si256(_mm256_unpackhi_epi64(b11, b21), _mm256_unpackhi_epi64(b31, b41), 0x20);
+				const auto n311 = _mm256_permute4x64_epi64(blend_256(b20, b41, b21, b11), 0x39);
+				const auto n312 = _mm256_permute4x64_epi64(blend_256(b21, b20, b11, b41), 0x1E);
+				const auto n211 = _mm256_permute4x64_epi64(blend_256(p21, b11, b31, b41), 0x39);
+				const auto n212 = _mm256_permute4x64_epi64(blend_256(b31, p21, b41, b11), 0x1E);
+				const auto n411 = _mm256_permute4x64_epi64(blend_256(p41, b21, b11, b31), 0x39);
+				const auto n412 = _mm256_permute4x64_epi64(blend_256(b11, p41, b31, b21), 0x1E);
+				const auto n111 = _mm256_permute4x64_epi64(blend_256(p11, b31, b41, b21), 0x39);
+				const auto n112 = _mm256_permute4x64_epi64(blend_256(b41, p11, b21, b31), 0x1E);
+
+				a00 = _mm256_xor_si256(a00, _mm256_andnot_si256(n001, n002));
+				a01 = _mm256_xor_si256(b01, _mm256_andnot_si256(n011, n012));
+				a20 = _mm256_xor_si256(b20, _mm256_andnot_si256(n201, n202));
+				a31 = _mm256_xor_si256(b31, _mm256_andnot_si256(n311, n312));
+				a21 = _mm256_xor_si256(b21, _mm256_andnot_si256(n211, n212));
+				a41 = _mm256_xor_si256(b41, _mm256_andnot_si256(n411, n412));
+				a11 = _mm256_xor_si256(b11, _mm256_andnot_si256(n111, n112));
+
+				// Iota
+				a00 = _mm256_xor_si256(a00, _mm256_set1_epi64x(static_cast<long long>(round_constants[i])));
+			}
+
+			lane_type unused[3];
+			get_lanes_256(a00, s[0][0], unused[0], unused[1], unused[2]);
+			get_lanes_256(a01, s[0][1], s[0][2], s[0][3], s[0][4]);
+			get_lanes_256(a20, s[2][0], s[4][0], s[1][0], s[3][0]);
+			get_lanes_256(a31, s[3][1], s[1][2], s[4][3], s[2][4]);
+			get_lanes_256(a21, s[2][1], s[4][2], s[1][3], s[3][4]);
+			get_lanes_256(a41, s[4][1], s[3][2], s[2][3], s[1][4]);
+			get_lanes_256(a11, s[1][1], s[2][2], s[3][3], s[4][4]);
+		}
+
+		// AVX2 implementation for four independent states, register aYX holds lane [Y][X] of all of them.
+
+		template <unsigned N>
+		KECCAK_TARGET("avx2") inline __m256i rol_x4(__m256i v0)
+		{
+			return _mm256_or_si256(_mm256_slli_epi64(v0, N), _mm256_srli_epi64(v0, 64 - N));
+		}
+
+		KECCAK_TARGET("avx2") inline __m256i xor_x4(__m256i v0, __m256i v1)
+		{
+			return _mm256_xor_si256(v0, v1);
+		}
+
+		// Swaps lanes i of vj with lanes j of vi, which turns four lanes of four states into four lanes of all states and back.
+		KECCAK_TARGET("avx2") inline void transpose_x4(__m256i& v0, __m256i& v1, __m256i& v2, __m256i& v3)
+		{
+			const auto t0 = _mm256_unpacklo_epi64(v0, v1);
+			const auto t1 = _mm256_unpackhi_epi64(v0, v1);
+			const auto t2 = _mm256_unpacklo_epi64(v2, v3);
+			const auto t3 = _mm256_unpackhi_epi64(v2, v3);
+
+			v0 = _mm256_permute2x128_si256(t0, t2, 0x20);
+			v1 = _mm256_permute2x128_si256(t1, t3, 0x20);
+			v2 = _mm256_permute2x128_si256(t0, t2, 0x31);
+			v3 = _mm256_permute2x128_si256(t1, t3, 0x31);
+		}
+
+		KECCAK_TARGET("avx2") void keccak_f_x4_avx2(state_type& s0, state_type& s1, state_type& s2, state_type& s3)
+		{
+			const std::array<lane_type*, 4> lanes = { s0[0].data(), s1[0].data(), s2[0].data(), s3[0].data() };
+			std::array<__m256i, 25> v;
+
+			for (std::size_t i = 0; i < 24; i += 4)
+			{
+				for (std::size_t j = 0; j < 4; ++j)
+				{
+					v[i + j] = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(lanes[j] + i));
+				}
+
+				transpose_x4(v[i], v[i + 1], v[i + 2], v[i + 3]);
+			}
+
+			v[24] = _mm256_set_epi64x(static_cast<long long>(lanes[3][24]), static_cast<long long>(lanes[2][24]),
+				static_cast<long long>(lanes[1][24]), static_cast<long long>(lanes[0][24]));
+
+			auto a00 = v[0], a01 = v[1], a02 = v[2], a03 = v[3], a04 = v[4];
+			auto a10 = v[5], a11 = v[6], a12 = v[7], a13 = v[8], a14 = v[9];
+			auto a20 = v[10], a21 = v[11], a22 = v[12], a23 = v[13], a24 = v[14];
+			auto a30 = v[15], a31 = v[16], a32 = v[17], a33 = v[18], a34 = v[19];
+			auto a40 = v[20], a41 = v[21], a42 = v[22], a43 = v[23], a44 = v[24];
+
+			for (std::size_t i = 0; i < round_constants.size(); ++i)
+			{
+				const auto c0 = xor_x4(xor_x4(xor_x4(xor_x4(a00, a10), a20), a30), a40);
+				const auto c1 = xor_x4(xor_x4(xor_x4(xor_x4(a01, a11), a21), a31), a41);
+				const auto c2 = xor_x4(xor_x4(xor_x4(xor_x4(a02, a12), a22), a32), a42);
+				const auto c3 = xor_x4(xor_x4(xor_x4(xor_x4(a03, a13), a23), a33), a43);
+				const auto c4 = xor_x4(xor_x4(xor_x4(xor_x4(a04, a14), a24), a34), a44);
+
+				const auto d0 = xor_x4(c4, rol_x4<1>(c1));
+				const auto d1 = xor_x4(c0, rol_x4<1>(c2));
+				const auto d2 = xor_x4(c1, rol_x4<1>(c3));
+				const auto d3 = xor_x4(c2, rol_x4<1>(c4));
+				const auto d4 = xor_x4(c3, rol_x4<1>(c0));
+
+				const auto b00 = xor_x4(a00, d0);
+				const auto b01 = rol_x4<44>(xor_x4(a11, d1));
+				const auto b02 = rol_x4<43>(xor_x4(a22, d2));
+				const auto b03 = rol_x4<21>(xor_x4(a33, d3));
+				const auto b04 = rol_x4<14>(xor_x4(a44, d4));
+
+				const auto b10 = rol_x4<28>(xor_x4(a03, d3));
+				const auto b11 = rol_x4<20>(xor_x4(a14, d4));
+				const auto b12 = rol_x4<3>(xor_x4(a20, d0));
+				const auto b13 = rol_x4<45>(xor_x4(a31, d1));
+				const auto b14 = rol_x4<61>(xor_x4(a42, d2));
+
+				const auto b20 = rol_x4<1>(xor_x4(a01, d1));
+				const auto b21 = rol_x4<6>(xor_x4(a12, d2));
+				const auto b22 = rol_x4<25>(xor_x4(a23, d3));
+				const auto b23 = rol_x4<8>(xor_x4(a34, d4));
+				const auto b24 = rol_x4<18>(xor_x4(a40, d0));
+
+				const auto b30 = rol_x4<27>(xor_x4(a04, d4));
+				const auto b31 = rol_x4<36>(xor_x4(a10, d0));
+				const auto b32 = rol_x4<10>(xor_x4(a21, d1));
+				const auto b33 = rol_x4<15>(xor_x4(a32, d2));
+				const auto b34 = rol_x4<56>(xor_x4(a43, d3));
+
+				const auto b40 = rol_x4<62>(xor_x4(a02, d2));
+				const auto b41 = rol_x4<55>(xor_x4(a13, d3));
+				const auto b42 = rol_x4<39>(xor_x4(a24, d4));
+				const auto b43 = rol_x4<41>(xor_x4(a30, d0));
+				const auto b44 = rol_x4<2>(xor_x4(a41, d1));
+
+				a00 = xor_x4(b00, _mm256_andnot_si256(b01, b02));
+				a01 = xor_x4(b01, _mm256_andnot_si256(b02, b03));
+				a02 = xor_x4(b02, _mm256_andnot_si256(b03, b04));
+				a03 = xor_x4(b03, _mm256_andnot_si256(b04, b00));
+				a04 = xor_x4(b04, _mm256_andnot_si256(b00, b01));
+
+				a10 = xor_x4(b10, _mm256_andnot_si256(b11, b12));
+				a11 = xor_x4(b11, _mm256_andnot_si256(b12, b13));
+				a12 = xor_x4(b12, _mm256_andnot_si256(b13, b14));
+				a13 = xor_x4(b13, _mm256_andnot_si256(b14, b10));
+				a14 = xor_x4(b14, _mm256_andnot_si256(b10, b11));
+
+				a20 = xor_x4(b20, _mm256_andnot_si256(b21, b22));
+				a21 = xor_x4(b21, _mm256_andnot_si256(b22, b23));
+				a22 = xor_x4(b22, _mm256_andnot_si256(b23, b24));
+				a23 = xor_x4(b23, _mm256_andnot_si256(b24, b20));
+				a24 = xor_x4(b24, _mm256_andnot_si256(b20, b21));
+
+				a30 = xor_x4(b30, _mm256_andnot_si256(b31, b32));
+				a31 = xor_x4(b31, _mm256_andnot_si256(b32, b33));
+				a32 = xor_x4(b32, _mm256_andnot_si256(b33, b34));
+				a33 = xor_x4(b33, _mm256_andnot_si256(b34, b30));
+				a34 = xor_x4(b34, _mm256_andnot_si256(b30, b31));
+
+				a40 = xor_x4(b40, _mm256_andnot_si256(b41, b42));
+				a41 = xor_x4(b41, _mm256_andnot_si256(b42, b43));
+				a42 = xor_x4(b42, _mm256_andnot_si256(b43, b44));
+				a43 = xor_x4(b43, _mm256_andnot_si256(b44, b40));
+				a44 = xor_x4(b44, _mm256_andnot_si256(b40, b41));
+
+				a00 = xor_x4(a00, _mm256_set1_epi64x(static_cast<long long>(round_constants[i])));
+			}
+
+			v[0] = a00;
+			v[1] = a01;
+			v[2] = a02;
+			v[3] = a03;
+			v[4] = a04;
+			v[5] = a10;
+			v[6] = a11;
+			v[7] = a12;
+			v[8] = a13;
+			v[9] = a14;
+			v[10] = a20;
+			v[11] = a21;
+			v[12] = a22;
+			v[13] = a23;
+			v[14] = a24;
+			v[15] = a30;
+			v[16] = a31;
+			v[17] = a32;
+			v[18] = a33;
+			v[19] = a34;
+			v[20] = a40;
+			v[21] = a41;
+			v[22] = a42;
+			v[23] = a43;
+			v[24] = a44;
+
+			for (std::size_t i = 0; i < 24; i += 4)
+			{
+				transpose_x4(v[i], v[i + 1], v[i + 2], v[i + 3]);
+
+				for (std::size_t j = 0; j < 4; ++j)
+				{
+					_mm256_storeu_si256(reinterpret_cast<__m256i*>(lanes[j] + i), v[i + j]);
+				}
+			}
+
+			alignas(32) std::array<lane_type, 4> last;
+			_mm256_store_si256(reinterpret_cast<__m256i*>(last.data()), v[24]);
+
+			for (std::size_t j = 0; j < 4; ++j)
+			{
+				lanes[j][24] = last[j];
+			}
+		}
+#endif
+
+		void keccak_f(state_type& s)
+		{
+#if defined(KECCAK_AVX2_AVAILABLE)
+			if (has_avx2())
+			{
+				keccak_f_avx2(s);
+				return;
+			}
+#endif
+
+			keccak_f_scalar(s);
+		}
+
+		void keccak_f_x4(state_type& s0, state_type& s1, state_type& s2, state_type& s3)
+		{
+#if defined(KECCAK_AVX2_AVAILABLE)
+			if (has_avx2())
+			{
+				keccak_f_x4_avx2(s0, s1, s2, s3);
+				return;
+			}
+#endif
+
+			keccak_f_scalar(s0);
+			keccak_f_scalar(s1);
+			keccak_f_scalar(s2);
+			keccak_f_scalar(s3);
+		}
+
+		// Permutes count states, four at a time where possible.
+		void keccak_f_many(state_type* const* states, std::size_t count)
+		{
+			std::size_t i = 0;
+
+			for (; count - i >= 4; i += 4)
+			{
+				keccak_f_x4(*states[i], *states[i + 1], *states[i + 2], *states[i + 3]);
+			}
+
+#if defined(KECCAK_AVX2_AVAILABLE)
+			if (count - i >= 2 && has_avx2())
+			{ // Permuting two or three states costs the same as four.
+				state_type unused[2];
+				keccak_f_x4_avx2(*states[i], *states[i + 1],
+					count - i == 3 ? *states[i + 2] : unused[0], unused[1]);
+				return;
+			}
+#endif
+
+			for (; i < count; ++i)
+			{
+				keccak_f(*states[i]);
 			}
 		}
 
@@ -465,7 +951,12 @@ namespace keccak
 				// assert(_capacity.byte_rate() - 1 >= data_size);
 
 				memory_xor(state_bytes(), data, data_size);
+				pad_transform(data_size, dom);
+			}
 
+			// For data that was already xored into the state.
+			void pad_transform(std::size_t data_size, domain dom)
+			{
 				state_bytes()[data_size] ^= (1u << dom.size()) | dom.value();
 				state_bytes()[_capacity.byte_rate() - 1] ^= 128u;
 
@@ -481,6 +972,7 @@ namespace keccak
 		class sponge_wrap
 		{
 			sponge_duplex _sponge;
+			std::size_t _block_bytes = 0; // of the current body block
 
 		public:
 			sponge_wrap(capacity cap, const void* key, std::size_t size)
@@ -490,7 +982,7 @@ namespace keccak
 
 				while (size > duplex_rate)
 				{
-					_sponge.absorb_transform(key, size, domain::make<1>());
+					_sponge.absorb_transform(key, duplex_rate, domain::make<1>());
 					advance_region(duplex_rate, size, key);
 				}
 
@@ -501,20 +993,24 @@ namespace keccak
 				void* buffer, const void* body, std::size_t body_and_buffer_size,
 				void* tag, std::size_t tag_size)
 			{
-				wrap_impl(header, header_size, buffer, body, body_and_buffer_size, tag, tag_size, body);
+				absorb_header(header, header_size);
+				wrap_body(buffer, body, body_and_buffer_size);
+				squeeze_tag(tag, tag_size);
 			}
 
 			void unwrap(const void* header, std::size_t header_size,
 				void* buffer, const void* body, std::size_t body_and_buffer_size,
 				void* tag, std::size_t tag_size)
 			{
-				wrap_impl(header, header_size, buffer, body, body_and_buffer_size, tag, tag_size, buffer);
+				absorb_header(header, header_size);
+				unwrap_body(buffer, body, body_and_buffer_size);
+				squeeze_tag(tag, tag_size);
 			}
 
-		private:
-			void wrap_impl(const void* header, std::size_t header_size,
-				void* buffer, const void* body, std::size_t body_and_buffer_size,
-				void* tag, std::size_t tag_size, const void* duplex_source)
+			// wrap() and unwrap() in parts: one absorb_header(), any number of
+			// wrap_body()/unwrap_body() calls (buffer may equal body) and one squeeze_tag().
+
+			void absorb_header(const void* header, std::size_t header_size)
 			{
 				// We need to leave 1 byte for padding, as each block gets
 				// padded, unlike in the normal sponge mode.
@@ -523,21 +1019,27 @@ namespace keccak
 
 				while (header_size > duplex_rate)
 				{
-					_sponge.absorb_transform(header, header_size, domain::make<0>());
+					_sponge.absorb_transform(header, duplex_rate, domain::make<0>());
 					advance_region(duplex_rate, header_size, header);
 				}
 
 				_sponge.absorb_transform(header, header_size, domain::make<1>());
+			}
 
-				while (body_and_buffer_size > duplex_rate)
-				{
-					memory_xor(buffer, body, _sponge.state_bytes(), duplex_rate);
-					_sponge.absorb_transform(duplex_source, duplex_rate, domain::make<0>());
-					advance_region(duplex_rate, body_and_buffer_size, buffer, body);
-				}
+			void wrap_body(void* buffer, const void* body, std::size_t size)
+			{
+				transform_body(buffer, body, size, true);
+			}
 
-				memory_xor(buffer, body, _sponge.state_bytes(), body_and_buffer_size);
-				_sponge.absorb_transform(duplex_source, body_and_buffer_size, domain::make<0>());
+			void unwrap_body(void* buffer, const void* body, std::size_t size)
+			{
+				transform_body(buffer, body, size, false);
+			}
+
+			void squeeze_tag(void* tag, std::size_t tag_size)
+			{
+				// The last body block, full, partial or empty, is the only one with domain 0.
+				_sponge.pad_transform(_block_bytes, domain::make<0>());
 
 				while (tag_size > _sponge.byte_rate()) // We can use the full rate as output.
 				{
@@ -548,6 +1050,41 @@ namespace keccak
 
 				std::memcpy(tag, _sponge.state_bytes(), tag_size);
 			}
+
+		private:
+			void transform_body(void* buffer, const void* body, std::size_t size, bool encrypt)
+			{
+				const auto duplex_rate = _sponge.byte_rate() - 1;
+
+				while (size > 0)
+				{
+					// A full block waits until more data shows that it isn't the last one,
+					// otherwise a body cut at a block boundary would get the same framing.
+					if (_block_bytes == duplex_rate)
+					{
+						_sponge.pad_transform(duplex_rate, domain::make<1>());
+						_block_bytes = 0;
+					}
+
+					const auto chunk_size = std::min(size, duplex_rate - _block_bytes);
+					const auto state = _sponge.state_bytes() + _block_bytes;
+
+					// The plaintext gets absorbed, which leaves the ciphertext in the state.
+					memory_xor(buffer, body, state, chunk_size);
+
+					if (encrypt)
+					{
+						std::memcpy(state, buffer, chunk_size);
+					}
+					else
+					{
+						memory_xor(state, buffer, chunk_size);
+					}
+
+					_block_bytes += chunk_size;
+					advance_region(chunk_size, size, buffer, body);
+				}
+			}
 		};
 
 		template <std::uint8_t Domain>
@@ -634,6 +1171,8 @@ namespace keccak
 			static constexpr std::size_t collision_resistance = CollisionResistance;
 			static constexpr std::size_t preimage_resistance = PreimageResistance;
 
+			static constexpr std::uint8_t hash_domain = Domain;
+
 			static constexpr std::size_t capacity = std::max(collision_resistance * 2, preimage_resistance * 2);
 			static constexpr std::size_t hash_size = std::max(collision_resistance * 2 / 8, preimage_resistance / 8);
 
@@ -672,6 +1211,344 @@ namespace keccak
 			}
 		};
 
+		// Hashes N independent messages, permuting the states together whenever several of them fill up.
+		template <std::size_t CollisionResistance, std::size_t PreimageResistance, std::uint8_t Domain, std::size_t N>
+		class basic_multi_hasher
+		{
+		public:
+			static constexpr std::size_t collision_resistance = CollisionResistance;
+			static constexpr std::size_t preimage_resistance = PreimageResistance;
+			static constexpr std::size_t messages = N;
+
+			static constexpr std::size_t capacity = std::max(collision_resistance * 2, preimage_resistance * 2);
+			static constexpr std::size_t hash_size = std::max(collision_resistance * 2 / 8, preimage_resistance / 8);
+
+			typedef std::array<std::uint8_t, hash_size> hash_type;
+
+		private:
+			static constexpr std::size_t byte_rate = capacity::make<capacity>().byte_rate();
+
+			std::array<state_type, N> _states = {};
+			std::array<std::size_t, N> _bytes_processed = {};
+
+		public:
+			void update(std::array<const void*, N> data, std::array<std::size_t, N> sizes)
+			{
+				for (;;)
+				{
+					bool done = true;
+
+					for (std::size_t i = 0; i < N; ++i)
+					{
+						const auto chunk_size = std::min(sizes[i], byte_rate - _bytes_processed[i]);
+						memory_xor(state_bytes(i) + _bytes_processed[i], data[i], chunk_size);
+
+						_bytes_processed[i] += chunk_size;
+						advance_region(chunk_size, sizes[i], data[i]);
+						done = done && sizes[i] == 0;
+					}
+
+					transform_full();
+
+					if (done)
+					{
+						break;
+					}
+				}
+			}
+
+			void update(const std::array<const void*, N>& data, std::size_t size)
+			{
+				std::array<std::size_t, N> sizes;
+				sizes.fill(size);
+				update(data, sizes);
+			}
+
+			void finish(std::array<void*, N> buffers, std::size_t size)
+			{
+				static constexpr auto dom = domain::make<Domain>();
+
+				for (std::size_t i = 0; i < N; ++i)
+				{
+					state_bytes(i)[_bytes_processed[i]] ^= (1u << dom.size()) | dom.value();
+					state_bytes(i)[byte_rate - 1] ^= 128u;
+					_bytes_processed[i] = byte_rate;
+				}
+
+				while (size > 0)
+				{
+					transform_full();
+
+					const auto chunk_size = std::min(size, byte_rate);
+
+					for (std::size_t i = 0; i < N; ++i)
+					{
+						std::memcpy(buffers[i], state_bytes(i), chunk_size);
+						buffers[i] = static_cast<std::uint8_t*>(buffers[i]) + chunk_size;
+						_bytes_processed[i] = byte_rate;
+					}
+
+					size -= chunk_size;
+				}
+
+				*this = basic_multi_hasher();
+			}
+
+			std::array<hash_type, N> finish()
+			{
+				std::array<hash_type, N> hashes;
+				std::array<void*, N> buffers;
+
+				for (std::size_t i = 0; i < N; ++i)
+				{
+					buffers[i] = hashes[i].data();
+				}
+
+				finish(buffers, hash_size);
+				return hashes;
+			}
+
+		private:
+			std::uint8_t* state_bytes(std::size_t i)
+			{
+				return reinterpret_cast<std::uint8_t*>(_states[i][0].data());
+			}
+
+			void transform_full()
+			{
+				std::array<state_type*, N> full;
+				std::size_t count = 0;
+
+				for (std::size_t i = 0; i < N; ++i)
+				{
+					if (_bytes_processed[i] == byte_rate)
+					{
+						full[count++] = &_states[i];
+						_bytes_processed[i] = 0;
+					}
+				}
+
+				keccak_f_many(full.data(), count);
+			}
+		};
+
+		// Leaves are padded with a domain no hasher uses, so a chaining value
+		// never equals the hash of the same bytes as a whole message.
+		constexpr std::uint8_t tree_leaf_domain = 11;
+
+		// Splits the message into leaves of LeafSize bytes, hashes them independently
+		// and hashes their chaining values together with the message size.
+		template <std::size_t CollisionResistance, std::size_t PreimageResistance, std::uint8_t Domain, std::size_t LeafSize>
+		class basic_tree_hasher
+		{
+		public:
+			static constexpr std::size_t collision_resistance = CollisionResistance;
+			static constexpr std::size_t preimage_resistance = PreimageResistance;
+			static constexpr std::size_t leaf_size = LeafSize;
+
+			static constexpr std::size_t capacity = std::max(collision_resistance * 2, preimage_resistance * 2);
+			static constexpr std::size_t hash_size = std::max(collision_resistance * 2 / 8, preimage_resistance / 8);
+
+			typedef std::array<std::uint8_t, hash_size> hash_type;
+
+		private:
+			typedef basic_hasher<CollisionResistance, PreimageResistance, tree_leaf_domain> leaf_hasher;
+			typedef basic_multi_hasher<CollisionResistance, PreimageResistance, tree_leaf_domain, 4> leaf_multi_hasher;
+
+			// Threads only get started for at least this many leaves each.
+			static constexpr std::size_t min_leaves_per_thread = std::max(std::size_t{ 1 }, 64 * 1024 / leaf_size);
+
+			// Leaves that don't arrive as part of a whole group of four are collected here,
+			// so hashing a message in pieces still permutes four leaves at once.
+			static constexpr std::size_t group_size = 4 * leaf_size;
+
+			basic_hasher<CollisionResistance, PreimageResistance, Domain> _root;
+			std::vector<std::uint8_t> _buffer;
+			std::size_t _buffered = 0;
+			std::uint64_t _total_bytes = 0;
+			std::size_t _threads;
+			bool _first_leaf_deferred = false;
+			std::vector<hash_type> _deferred_chaining_values;
+
+		public:
+			explicit basic_tree_hasher(std::size_t threads = 1)
+				: _threads(std::max(std::size_t{ 1 }, threads))
+			{}
+
+			basic_tree_hasher(const void* data, std::size_t size, std::size_t threads = 1)
+				: basic_tree_hasher(threads)
+			{
+				update(data, size);
+			}
+
+			void update(const void* data, std::size_t size)
+			{
+				_total_bytes += size;
+
+				if (_buffered > 0)
+				{
+					const auto chunk_size = std::min(size, group_size - _buffered);
+					std::memcpy(&_buffer[_buffered], data, chunk_size);
+
+					_buffered += chunk_size;
+					advance_region(chunk_size, size, data);
+
+					if (_buffered < group_size)
+					{
+						return;
+					}
+
+					hash_leaves(_buffer.data(), 4);
+					_buffered = 0;
+				}
+
+				const auto leaves = size / group_size * 4;
+				hash_leaves(static_cast<const std::uint8_t*>(data), leaves);
+				advance_region(leaves * leaf_size, size, data);
+
+				if (size > 0)
+				{
+					_buffer.resize(group_size);
+					std::memcpy(_buffer.data(), data, size);
+					_buffered = size;
+				}
+			}
+
+			// For messages that start with something only known at the end: update() continues
+			// after the first leaf, which is passed to finish_first_leaf() before finish().
+			// Has to be called before anything else.
+			void defer_first_leaf()
+			{
+				_first_leaf_deferred = true;
+				_total_bytes = leaf_size;
+			}
+
+			// Takes the first leaf_size bytes of the message (all of it, if it's shorter).
+			void finish_first_leaf(const void* data, std::size_t size)
+			{
+				_first_leaf_deferred = false;
+				_total_bytes -= leaf_size - size;
+
+				if (size > 0)
+				{
+					absorb_chaining_value(leaf_hasher(data, size).finish());
+				}
+
+				for (auto& chaining_value : _deferred_chaining_values)
+				{
+					absorb_chaining_value(chaining_value);
+				}
+
+				_deferred_chaining_values.clear();
+			}
+
+			void finish(void* buf, std::size_t size)
+			{
+				const auto leaves = _buffered / leaf_size;
+				hash_leaves(_buffer.data(), leaves);
+
+				if (_buffered > leaves * leaf_size)
+				{
+					absorb_chaining_value(leaf_hasher(&_buffer[leaves * leaf_size], _buffered - leaves * leaf_size).finish());
+				}
+
+				_root.update(&_total_bytes, sizeof _total_bytes);
+				_root.finish(buf, size);
+				*this = basic_tree_hasher(_threads);
+			}
+
+			hash_type finish()
+			{
+				hash_type hash;
+				finish(hash.data(), hash.size());
+				return hash;
+			}
+
+		private:
+			void absorb_chaining_value(const hash_type& chaining_value)
+			{
+				if (_first_leaf_deferred)
+				{
+					_deferred_chaining_values.push_back(chaining_value);
+				}
+				else
+				{
+					_root.update(chaining_value.data(), chaining_value.size());
+				}
+			}
+
+			static void hash_leaf_range(const std::uint8_t* data, hash_type* chaining_values, std::size_t count)
+			{
+				for (; count >= 4; count -= 4)
+				{
+					leaf_multi_hasher hasher;
+					hasher.update({ data, data + leaf_size, data + 2 * leaf_size, data + 3 * leaf_size }, leaf_size);
+					hasher.finish({ chaining_values[0].data(), chaining_values[1].data(),
+						chaining_values[2].data(), chaining_values[3].data() }, hash_size);
+
+					data += 4 * leaf_size;
+					chaining_values += 4;
+				}
+
+				for (; count > 0; --count)
+				{
+					*chaining_values++ = leaf_hasher(data, leaf_size).finish();
+					data += leaf_size;
+				}
+			}
+
+			void hash_leaves(const std::uint8_t* data, std::size_t count)
+			{
+				if (count == 0)
+				{
+					return;
+				}
+
+				std::vector<hash_type> chaining_values(count);
+
+				// Chunks are whole groups of four leaves, so the permutations stay interleaved.
+				const auto threads = std::max(std::size_t{ 1 }, std::min(_threads, count / min_leaves_per_thread));
+				const auto chunk_leaves = ((count + threads - 1) / threads + 3) / 4 * 4;
+
+				const auto hash_chunk = [&](std::size_t first)
+				{
+					hash_leaf_range(data + first * leaf_size, &chaining_values[first], std::min(chunk_leaves, count - first));
+				};
+
+				std::vector<std::thread> workers;
+				workers.reserve(threads - 1);
+				std::size_t first = chunk_leaves;
+
+				try
+				{
+					for (; first < count; first += chunk_leaves)
+					{
+						workers.emplace_back(hash_chunk, first);
+					}
+				}
+				catch (...)
+				{ // Couldn't start another thread, the remaining chunks are done on this one.
+				}
+
+				for (auto rest = first; rest < count; rest += chunk_leaves)
+				{
+					hash_chunk(rest);
+				}
+
+				hash_chunk(0);
+
+				for (auto& worker : workers)
+				{
+					worker.join();
+				}
+
+				for (auto& chaining_value : chaining_values)
+				{
+					absorb_chaining_value(chaining_value);
+				}
+			}
+		};
+
 		template <std::size_t SecurityStrength, cipher_mode Mode>
 		class basic_authenticated_cipher
 		{
@@ -690,6 +1567,18 @@ namespace keccak
 			void operator () (const void* header, std::size_t header_size,
 				void* buffer, const void* body, std::size_t body_and_buffer_size,
 				void* tag, std::size_t tag_size)
+			{
+				begin(header, header_size);
+				transform(buffer, body, body_and_buffer_size);
+				finish(tag, tag_size);
+			}
+
+			void begin(const void* header, std::size_t header_size)
+			{
+				_wrapper.absorb_header(header, header_size);
+			}
+
+			void transform(void* buffer, const void* body, std::size_t size)
 			{
 				switch (Mode)
 				{
@@ -697,13 +1586,18 @@ namespace keccak
 					// assert(false);
 					break;
 				case cipher_mode::encrypt:
-					_wrapper.wrap(header, header_size, buffer, body, body_and_buffer_size, tag, tag_size);
+					_wrapper.wrap_body(buffer, body, size);
 					break;
 				case cipher_mode::decrypt:
-					_wrapper.unwrap(header, header_size, buffer, body, body_and_buffer_size, tag, tag_size);
+					_wrapper.unwrap_body(buffer, body, size);
 					break;
 				}
 			}
+
+			void finish(void* tag, std::size_t tag_size)
+			{
+				_wrapper.squeeze_tag(tag, tag_size);
+			}
 		};
 
 		template <typename UIntType, std::size_t SecurityStrength>
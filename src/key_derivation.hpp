@@ -0,0 +1,383 @@
+#pragma once
+
+#include "secure_memory.hpp"
+#include "utility/barrier.hpp"
+#include "utility/stopwatch.hpp"
+
+#include "keccak/keccak.hpp"
+
+#include <cstdint>
+#include <cstring>
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <vector>
+
+/* Memory-hard key derivation
+ * Follows the structure of Argon2d, but every primitive is a Keccak sponge.
+ * All integers are stored in little endian.
+ *
+ * Memory consists of 1 KiB blocks, split into lanes, every lane into 4 segments.
+ * Lanes are filled in parallel and synchronize after every segment.
+ *
+ * compress(x, y) = shake256(x ^ y, 1024) ^ x ^ y
+ *
+ * h0 = sha3-512(iterations || memory_kib || lanes || password_size || password || nonce || domain)
+ * block[l][0] = shake256(h0 || uint32_t(0) || uint32_t(l), 1024)
+ * block[l][1] = shake256(h0 || uint32_t(1) || uint32_t(l), 1024)
+ * block[l][i] = compress(block[l][i - 1], block[l'][j])
+ *  ^ after the first pass the result is xored into the previous content of block[l][i].
+ *  ^ l' and j are taken from the first 8 bytes of block[l][i - 1].
+ *  ^ j is never in the segment that is currently being computed in l' (unless l' = l).
+ *
+ * key = sha3-256(h0 || block[0][last] ^ ... ^ block[lanes - 1][last])
+ */
+
+struct KdfParameters
+{
+	std::uint32_t iterations;
+	std::uint32_t memoryKiB;
+	std::uint8_t lanes;
+};
+
+constexpr std::uint32_t kdfSegments = 4;
+constexpr std::uint32_t kdfMaxIterations = 1u << 16;
+constexpr std::uint32_t kdfMaxMemoryKiB = 1u << 22;
+
+inline bool validKdfParameters(const KdfParameters& params)
+{
+	return params.lanes > 0
+		&& params.iterations > 0 && params.iterations <= kdfMaxIterations
+		&& params.memoryKiB >= 2 * kdfSegments * params.lanes && params.memoryKiB <= kdfMaxMemoryKiB;
+}
+
+typedef std::array<std::uint64_t, 128> KdfBlock;
+
+static_assert(sizeof(KdfBlock) == 1024, "std::array has padding.");
+
+// Compresses N independent block pairs, their shake256 permutations run in lockstep.
+template <std::size_t N>
+inline void kdfCompress(const std::array<KdfBlock*, N>& dest, const std::array<const KdfBlock*, N>& x,
+	const std::array<const KdfBlock*, N>& y, bool xorInto)
+{
+	std::array<KdfBlock, N> r;
+	std::array<KdfBlock, N> h;
+	std::array<const void*, N> messages;
+	std::array<void*, N> hashes;
+
+	for (std::size_t n = 0; n < N; ++n)
+	{
+		for (std::size_t i = 0; i < r[n].size(); ++i)
+		{
+			r[n][i] = (*x[n])[i] ^ (*y[n])[i];
+		}
+
+		messages[n] = r[n].data();
+		hashes[n] = h[n].data();
+	}
+
+	keccak::multi_hasher<keccak::shake256_hasher, N> hasher;
+	hasher.update(messages, sizeof(KdfBlock));
+	hasher.finish(hashes, sizeof(KdfBlock));
+
+	for (std::size_t n = 0; n < N; ++n)
+	{
+		auto& d = *dest[n];
+
+		for (std::size_t i = 0; i < d.size(); ++i)
+		{
+			d[i] = xorInto ? d[i] ^ h[n][i] ^ r[n][i] : h[n][i] ^ r[n][i];
+		}
+	}
+
+	volatileZeroMemory(&r, sizeof r);
+	volatileZeroMemory(&h, sizeof h);
+}
+
+inline void kdfCompress(KdfBlock& dest, const KdfBlock& x, const KdfBlock& y, bool xorInto)
+{
+	kdfCompress<1>({ &dest }, { &x }, { &y }, xorInto);
+}
+
+// Fills the current segment of N lanes. Blocks of one index are computed together,
+// which is safe because no lane references a segment another lane is working on.
+template <std::size_t N>
+inline void kdfFillSegments(KdfBlock* memory, const KdfParameters& params,
+	std::uint32_t pass, std::uint32_t slice, const std::array<std::uint32_t, N>& lanes)
+{
+	const std::uint32_t segmentLength = params.memoryKiB / (kdfSegments * params.lanes);
+	const std::uint32_t laneLength = segmentLength * kdfSegments;
+
+	for (std::uint32_t index = (pass == 0 && slice == 0) ? 2 : 0; index < segmentLength; ++index)
+	{
+		const std::uint32_t current = slice * segmentLength + index;
+		const std::uint32_t previous = current == 0 ? laneLength - 1 : current - 1;
+
+		std::array<KdfBlock*, N> dest;
+		std::array<const KdfBlock*, N> x;
+		std::array<const KdfBlock*, N> y;
+
+		for (std::size_t n = 0; n < N; ++n)
+		{
+			const std::uint32_t lane = lanes[n];
+			KdfBlock* laneMemory = memory + std::size_t{ lane } * laneLength;
+			const std::uint64_t pseudoRandom = laneMemory[previous][0];
+
+			const std::uint32_t refLane = (pass == 0 && slice == 0)
+				? lane : static_cast<std::uint32_t>((pseudoRandom >> 32) % params.lanes);
+
+			// Blocks in the segments other lanes are currently working on can't be referenced.
+			std::uint32_t areaSize;
+
+			if (pass == 0)
+			{
+				areaSize = refLane == lane ? current - 1 : slice * segmentLength;
+			}
+			else
+			{
+				areaSize = refLane == lane ? laneLength - segmentLength + index - 1 : laneLength - segmentLength;
+			}
+
+			const std::uint32_t areaStart = pass == 0 ? 0 : ((slice + 1) * segmentLength) % laneLength;
+			const std::uint32_t refIndex = (areaStart + static_cast<std::uint32_t>(pseudoRandom) % areaSize) % laneLength;
+
+			dest[n] = &laneMemory[current];
+			x[n] = &laneMemory[previous];
+			y[n] = &memory[std::size_t{ refLane } * laneLength + refIndex];
+		}
+
+		kdfCompress<N>(dest, x, y, pass != 0);
+	}
+}
+
+inline void kdfFillSegment(KdfBlock* memory, const KdfParameters& params,
+	std::uint32_t pass, std::uint32_t slice, std::uint32_t lane)
+{
+	kdfFillSegments<1>(memory, params, pass, slice, { lane });
+}
+
+inline std::array<std::uint8_t, 32> deriveKeyMemoryHard(const SecureString& password,
+	const std::array<std::uint8_t, 32>& nonce, const std::string& domain, const KdfParameters& params)
+{
+	if (!validKdfParameters(params))
+	{
+		throw std::invalid_argument("Invalid key derivation parameters.");
+	}
+
+	const std::uint32_t laneLength = params.memoryKiB / (kdfSegments * params.lanes) * kdfSegments;
+	const std::uint32_t passwordSize = static_cast<std::uint32_t>(password.size());
+
+	keccak::sha3_512_hasher hasher;
+	hasher.update(&params.iterations, sizeof params.iterations);
+	hasher.update(&params.memoryKiB, sizeof params.memoryKiB);
+	hasher.update(&params.lanes, sizeof params.lanes);
+	hasher.update(&passwordSize, sizeof passwordSize);
+	hasher.update(password.data(), password.size());
+	hasher.update(nonce.data(), nonce.size());
+	hasher.update(domain.data(), domain.size());
+
+	auto h0 = hasher.finish();
+	VolatileZeroGuard h0ZeroGuard(&h0, sizeof h0);
+
+	std::vector<KdfBlock, ScratchAllocator<KdfBlock>> memory(std::size_t{ laneLength } * params.lanes);
+
+	for (std::uint32_t lane = 0; lane < params.lanes; ++lane)
+	{
+		const std::uint32_t indices[2] = { 0, 1 };
+		KdfBlock* first = &memory[std::size_t{ lane } * laneLength];
+
+		keccak::multi_hasher<keccak::shake256_hasher, 2> blockHasher;
+		blockHasher.update({ h0.data(), h0.data() }, h0.size());
+		blockHasher.update({ &indices[0], &indices[1] }, sizeof indices[0]);
+		blockHasher.update({ &lane, &lane }, sizeof lane);
+		blockHasher.finish({ first, first + 1 }, sizeof(KdfBlock));
+	}
+
+	const std::uint32_t nThreads = std::max(1u, std::min<std::uint32_t>(params.lanes, std::thread::hardware_concurrency()));
+
+	// A thread with several lanes fills up to four of them in lockstep.
+	const auto fillLanes = [&](std::uint32_t pass, std::uint32_t slice, std::uint32_t firstLane)
+	{
+		std::uint32_t lane = firstLane;
+
+		for (; lane + 3 * nThreads < params.lanes; lane += 4 * nThreads)
+		{
+			kdfFillSegments<4>(memory.data(), params, pass, slice,
+				{ lane, lane + nThreads, lane + 2 * nThreads, lane + 3 * nThreads });
+		}
+
+		if (lane + 2 * nThreads < params.lanes)
+		{
+			kdfFillSegments<3>(memory.data(), params, pass, slice,
+				{ lane, lane + nThreads, lane + 2 * nThreads });
+		}
+		else if (lane + nThreads < params.lanes)
+		{
+			kdfFillSegments<2>(memory.data(), params, pass, slice, { lane, lane + nThreads });
+		}
+		else if (lane < params.lanes)
+		{
+			kdfFillSegment(memory.data(), params, pass, slice, lane);
+		}
+	};
+
+	// The workers live through all passes, a segment has to be complete
+	// in every lane before the next one may reference it.
+	Barrier segmentDone(nThreads);
+
+	const auto fillAllSegments = [&](std::uint32_t firstLane)
+	{
+		for (std::uint32_t pass = 0; pass < params.iterations; ++pass)
+		{
+			for (std::uint32_t slice = 0; slice < kdfSegments; ++slice)
+			{
+				fillLanes(pass, slice, firstLane);
+				segmentDone.arriveAndWait();
+			}
+		}
+	};
+
+	std::vector<std::thread> threads;
+	std::vector<std::uint32_t> leftOver;
+	threads.reserve(nThreads - 1);
+
+	for (std::uint32_t i = 1; i < nThreads; ++i)
+	{
+		try
+		{
+			threads.emplace_back(fillAllSegments, i);
+		}
+		catch (std::system_error&)
+		{ // Couldn't start another thread, this one takes over its lanes.
+			leftOver.push_back(i);
+			segmentDone.arriveAndDrop();
+		}
+	}
+
+	for (std::uint32_t pass = 0; pass < params.iterations; ++pass)
+	{
+		for (std::uint32_t slice = 0; slice < kdfSegments; ++slice)
+		{
+			fillLanes(pass, slice, 0);
+
+			for (const auto i : leftOver)
+			{
+				fillLanes(pass, slice, i);
+			}
+
+			segmentDone.arriveAndWait();
+		}
+	}
+
+	for (auto& thread : threads)
+	{
+		thread.join();
+	}
+
+	KdfBlock result = memory[laneLength - 1];
+
+	for (std::uint32_t lane = 1; lane < params.lanes; ++lane)
+	{
+		const auto& last = memory[std::size_t{ lane } * laneLength + laneLength - 1];
+
+		for (std::size_t i = 0; i < result.size(); ++i)
+		{
+			result[i] ^= last[i];
+		}
+	}
+
+	keccak::sha3_256_hasher finalHasher(h0.data(), h0.size());
+	finalHasher.update(result.data(), sizeof result);
+	volatileZeroMemory(&result, sizeof result);
+
+	return finalHasher.finish();
+}
+
+// Derives an independent subkey from a key that already went through deriveKeyMemoryHard().
+// An optional salt is absorbed between key and domain.
+inline std::array<std::uint8_t, 32> expandKey(const std::array<std::uint8_t, 32>& key,
+	const std::string& domain, const void* salt = nullptr, std::size_t saltSize = 0)
+{
+	std::array<std::uint8_t, 32> subkey;
+	keccak::shake256_hasher hasher(key.data(), key.size());
+	hasher.update(salt, saltSize);
+	hasher.update(domain.data(), domain.size());
+	hasher.finish(subkey.data(), subkey.size());
+	return subkey;
+}
+
+// Derives several subkeys at once, each identical to expandKey(key, domains[i], salt, saltSize).
+template <std::size_t N>
+inline std::array<std::array<std::uint8_t, 32>, N> expandKeys(const std::array<std::uint8_t, 32>& key,
+	const std::array<std::string, N>& domains, const void* salt = nullptr, std::size_t saltSize = 0)
+{
+	std::array<std::array<std::uint8_t, 32>, N> subkeys;
+	std::array<const void*, N> keys;
+	std::array<const void*, N> salts;
+	std::array<const void*, N> domainData;
+	std::array<std::size_t, N> domainSizes;
+	std::array<void*, N> buffers;
+
+	for (std::size_t i = 0; i < N; ++i)
+	{
+		keys[i] = key.data();
+		salts[i] = salt;
+		domainData[i] = domains[i].data();
+		domainSizes[i] = domains[i].size();
+		buffers[i] = subkeys[i].data();
+	}
+
+	keccak::multi_hasher<keccak::shake256_hasher, N> hasher;
+	hasher.update(keys, key.size());
+	hasher.update(salts, saltSize);
+	hasher.update(domainData, domainSizes);
+	hasher.finish(buffers, subkeys[0].size());
+	return subkeys;
+}
+
+// Picks parameters so that one derivation takes about targetTime on this machine.
+// Memory is raised first (up to maxMemoryKiB), the rest of the budget is spent on iterations.
+inline KdfParameters calibrateKdfParameters(std::chrono::milliseconds targetTime,
+	std::uint32_t maxMemoryKiB, std::uint8_t lanes)
+{
+	const SecureString password = "calibration";
+	const std::array<std::uint8_t, 32> nonce = {};
+
+	lanes = std::max<std::uint8_t>(lanes, 1);
+	maxMemoryKiB = std::max(2 * kdfSegments * lanes, std::min(maxMemoryKiB, kdfMaxMemoryKiB));
+
+	KdfParameters params = { 1, std::min(maxMemoryKiB, 4u * 1024), lanes };
+	double seconds = 0.0;
+
+	for (;;)
+	{
+		Stopwatch<> stopwatch;
+		deriveKeyMemoryHard(password, nonce, "CALIBRATION", params);
+		seconds = floatCast<double>(stopwatch.elapsed());
+
+		if (params.memoryKiB >= maxMemoryKiB || seconds * 2 >= floatCast<double>(targetTime))
+		{
+			break;
+		}
+
+		params.memoryKiB = std::min(maxMemoryKiB, params.memoryKiB * 2);
+	}
+
+	const auto scale = floatCast<double>(targetTime) / std::max(seconds, 1e-6);
+
+	if (params.memoryKiB < maxMemoryKiB && scale > 1.0)
+	{
+		params.memoryKiB = static_cast<std::uint32_t>(std::min<double>(maxMemoryKiB, params.memoryKiB * scale));
+	}
+	else
+	{
+		params.iterations = static_cast<std::uint32_t>(std::max(1.0, std::min<double>(kdfMaxIterations, scale)));
+	}
+
+	return params;
+}
@@ -49,6 +49,10 @@ int WINAPI wWinMain(HINSTANCE hinstance, HINSTANCE /* hprevinstance */, PWSTR cm
 
 	auto args = getArgs(cmdline);
 
+	// Locked pages count against the working set, make room for the secrets and the first slabs of entries.
+	// More gets added whenever a lock needs it.
+	LockedMemory::instance().reserve(8 * SecureArena::SLAB_SIZE);
+
 	auto standby = args.size() > 2 && args[2] == "standby";
 
 	const auto instanceString = L"XKXjdwnFYYL2eVdB";
@@ -73,7 +77,7 @@ int WINAPI wWinMain(HINSTANCE hinstance, HINSTANCE /* hprevinstance */, PWSTR cm
 	}
 
 	std::unique_ptr<LoginDatabase> database;
-	std::string password;
+	SecureString password;
 	std::string filename = getFullyQualifiedPathName(args.size() > 1 ? args[1] : "passchain.dat");
 
 	while (database == nullptr)
@@ -93,7 +97,8 @@ int WINAPI wWinMain(HINSTANCE hinstance, HINSTANCE /* hprevinstance */, PWSTR cm
 				return 0;
 			}
 
-			database = std::make_unique<LoginDatabase>(std::move(password));
+			database = std::make_unique<LoginDatabase>(password);
+			volatileZeroMemory(&password[0], password.size()); // &password[0] is always valid.
 
 			auto attributes = GetFileAttributesW(toWideString(filename).c_str());
 
@@ -110,6 +115,12 @@ int WINAPI wWinMain(HINSTANCE hinstance, HINSTANCE /* hprevinstance */, PWSTR cm
 		}
 	}
 
+	if (LockedMemory::instance().failed())
+	{
+		showMessageBox("Warning", "Not all memory holding passwords could be locked, "
+			"parts of it may be written to the page file.");
+	}
+
 	bool timeoutQuit = false;
 
 	MainDialogCreateParams mainParams;
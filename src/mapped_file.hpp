@@ -0,0 +1,133 @@
+#pragma once
+
+#ifdef _WIN32
+#include "windows/base.hpp"
+#include "windows/utf.hpp"
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include <cstddef>
+#include <cstdint>
+
+#include <stdexcept>
+#include <string>
+
+// Read-only view of a whole file.
+class MappedFile
+{
+	const std::uint8_t* _data = nullptr;
+	std::size_t _size = 0;
+
+#ifdef _WIN32
+	HANDLE _file = INVALID_HANDLE_VALUE;
+	HANDLE _mapping = nullptr;
+#else
+	int _file = -1;
+#endif
+
+public:
+	~MappedFile()
+	{
+		close();
+	}
+
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator = (const MappedFile&) = delete;
+
+	explicit MappedFile(const std::string& filename)
+	{
+#ifdef _WIN32
+		_file = CreateFileW(toWideString(filename).c_str(), GENERIC_READ, FILE_SHARE_READ,
+			nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+
+		LARGE_INTEGER fileSize;
+
+		if (_file == INVALID_HANDLE_VALUE || !GetFileSizeEx(_file, &fileSize))
+		{
+			close();
+			throw std::runtime_error("Unable to open database file.");
+		}
+
+		if (static_cast<std::uint64_t>(fileSize.QuadPart) > SIZE_MAX)
+		{
+			close();
+			throw std::runtime_error("Database file too large to map.");
+		}
+
+		_size = static_cast<std::size_t>(fileSize.QuadPart);
+
+		if (_size > 0)
+		{ // Empty files can't be mapped.
+			_mapping = CreateFileMappingW(_file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+			_data = _mapping == nullptr ? nullptr
+				: static_cast<const std::uint8_t*>(MapViewOfFile(_mapping, FILE_MAP_READ, 0, 0, 0));
+
+			if (_data == nullptr)
+			{
+				close();
+				throw std::runtime_error("Unable to map database file.");
+			}
+		}
+#else
+		_file = ::open(filename.c_str(), O_RDONLY);
+
+		struct stat fileStat;
+
+		if (_file < 0 || ::fstat(_file, &fileStat) != 0)
+		{
+			close();
+			throw std::runtime_error("Unable to open database file.");
+		}
+
+		_size = static_cast<std::size_t>(fileStat.st_size);
+
+		if (_size > 0)
+		{ // Empty files can't be mapped.
+			auto data = ::mmap(nullptr, _size, PROT_READ, MAP_PRIVATE, _file, 0);
+
+			if (data == MAP_FAILED)
+			{
+				close();
+				throw std::runtime_error("Unable to map database file.");
+			}
+
+			_data = static_cast<const std::uint8_t*>(data);
+			::madvise(data, _size, MADV_SEQUENTIAL);
+		}
+#endif
+	}
+
+	const std::uint8_t* data() const
+	{
+		return _data;
+	}
+
+	std::size_t size() const
+	{
+		return _size;
+	}
+
+private:
+	void close()
+	{
+#ifdef _WIN32
+		if (_data != nullptr)
+			UnmapViewOfFile(_data);
+		if (_mapping != nullptr)
+			CloseHandle(_mapping);
+		if (_file != INVALID_HANDLE_VALUE)
+			CloseHandle(_file);
+#else
+		if (_data != nullptr)
+			::munmap(const_cast<std::uint8_t*>(_data), _size);
+		if (_file >= 0)
+			::close(_file);
+#endif
+
+		_data = nullptr;
+	}
+};
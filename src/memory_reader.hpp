@@ -4,6 +4,8 @@
 #include <cstdint>
 #include <cstring>
 
+#include <algorithm>
+#include <functional>
 #include <stdexcept>
 
 class MemoryReader
@@ -36,3 +38,49 @@ public:
 		return false;
 	}
 };
+
+// Same interface as MemoryReader, but the data arrives in chunks.
+// fill(buffer, size) has to write up to size bytes to buffer and return how many it wrote (0 = no more data).
+class ChunkedReader
+{
+	std::function<std::size_t(std::uint8_t*, std::size_t)> _fill;
+	std::uint8_t* _buffer;
+	std::size_t _bufferSize;
+	std::size_t _position = 0;
+	std::size_t _end = 0;
+
+public:
+	ChunkedReader(void* buffer, std::size_t bufferSize, 
+		std::function<std::size_t(std::uint8_t*, std::size_t)> fill)
+		: _fill(std::move(fill))
+		, _buffer(static_cast<std::uint8_t*>(buffer))
+		, _bufferSize(bufferSize)
+	{}
+
+	bool read(void* buffer, std::size_t bytes)
+	{
+		auto bytePtr = static_cast<std::uint8_t*>(buffer);
+
+		while (bytes > 0)
+		{
+			if (_position == _end)
+			{
+				_position = 0;
+				_end = _fill(_buffer, _bufferSize);
+
+				if (_end == 0)
+				{
+					return false;
+				}
+			}
+
+			const auto n = std::min(bytes, _end - _position);
+			std::memcpy(bytePtr, _buffer + _position, n);
+			_position += n;
+			bytePtr += n;
+			bytes -= n;
+		}
+
+		return true;
+	}
+};
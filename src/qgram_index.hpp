@@ -0,0 +1,117 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include <algorithm>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Inverted index from the trigrams of (already case folded) words to the entries containing them.
+//
+// By the q-gram lemma a search word of length m that matches part of a word with k errors
+// shares at least (m - 2) - 3k of its trigrams with that word. Entries that share none of them
+// are therefore at least ceil((m - 2) / 3) away from it, see missingDistance().
+class QGramIndex
+{
+public:
+	static constexpr std::size_t Q = 3;
+
+private:
+	std::unordered_map<std::uint32_t, std::vector<std::uint32_t>> _postings; // gram -> entry positions, unordered
+	std::vector<std::vector<std::uint32_t>> _entryGrams; // position -> distinct grams it was indexed with
+
+public:
+	// Replaces the grams indexed for the entry at position.
+	void update(std::size_t position, const std::vector<std::string>& words)
+	{
+		if (position >= _entryGrams.size())
+		{
+			_entryGrams.resize(position + 1);
+		}
+
+		auto& grams = _entryGrams[position];
+		const auto entry = static_cast<std::uint32_t>(position);
+
+		for (auto gram : grams)
+		{
+			auto& posting = _postings[gram];
+			auto it = std::find(posting.begin(), posting.end(), entry);
+
+			if (it != posting.end())
+			{
+				*it = posting.back();
+				posting.pop_back();
+			}
+		}
+
+		grams.clear();
+
+		for (const auto& word : words)
+		{
+			appendGrams(word, grams);
+		}
+
+		std::sort(grams.begin(), grams.end());
+		grams.erase(std::unique(grams.begin(), grams.end()), grams.end());
+
+		for (auto gram : grams)
+		{
+			_postings[gram].push_back(entry);
+		}
+	}
+
+	// Calls f(position) for every entry sharing a gram with one of the words, possibly more than once.
+	template <typename Function>
+	void forEachCandidate(const std::vector<std::string>& words, Function&& f) const
+	{
+		std::vector<std::uint32_t> grams;
+
+		for (const auto& word : words)
+		{
+			appendGrams(word, grams);
+		}
+
+		std::sort(grams.begin(), grams.end());
+		grams.erase(std::unique(grams.begin(), grams.end()), grams.end());
+
+		for (auto gram : grams)
+		{
+			auto it = _postings.find(gram);
+
+			if (it != _postings.end())
+			{
+				for (auto position : it->second)
+				{
+					f(static_cast<std::size_t>(position));
+				}
+			}
+		}
+	}
+
+	// Lower bound of wordBasedEditDistance() for entries that share no gram with any of the words.
+	static std::uint32_t missingDistance(const std::vector<std::string>& words)
+	{
+		std::uint32_t distance = 0;
+
+		for (const auto& word : words)
+		{
+			// ceil((m - Q + 1) / Q), which is 0 for words shorter than Q.
+			distance += static_cast<std::uint32_t>(word.size() / Q);
+		}
+
+		return distance;
+	}
+
+private:
+	static void appendGrams(const std::string& word, std::vector<std::uint32_t>& grams)
+	{
+		for (std::size_t i = 0; i + Q <= word.size(); ++i)
+		{
+			grams.push_back(static_cast<std::uint32_t>(static_cast<unsigned char>(word[i])) << 16
+				| static_cast<std::uint32_t>(static_cast<unsigned char>(word[i + 1])) << 8
+				| static_cast<std::uint32_t>(static_cast<unsigned char>(word[i + 2])));
+		}
+	}
+};
@@ -4,6 +4,8 @@
 #define WM_SETTINGS_APPLIED (WM_APP + 3)
 #define WM_CLEAR_CLIPBOARD (WM_APP + 4)
 #define WM_CHECK_INACTIVE_TIME (WM_APP + 5)
+#define WM_SEARCH_FINISHED (WM_APP + 6)
+#define WM_KDF_CALIBRATED (WM_APP + 7)
 
 // The resource compiler doesn't understand __LINE__ or __COUNTER__.
 // It also can't parse spaces in definitions.
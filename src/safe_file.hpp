@@ -0,0 +1,98 @@
+#pragma once
+
+#ifdef _WIN32
+#include "windows/base.hpp"
+#include "windows/utf.hpp"
+#include <io.h>
+#else
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#include <cstdint>
+#include <cstdio>
+
+#include <string>
+
+// long is only 32 bits on Windows, so files past 2 GiB need these.
+inline bool seekFile(std::FILE* file, std::uint64_t offset, int origin = SEEK_SET)
+{
+#ifdef _WIN32
+	return _fseeki64(file, static_cast<__int64>(offset), origin) == 0;
+#else
+	return fseeko(file, static_cast<off_t>(offset), origin) == 0;
+#endif
+}
+
+// Returns 0 on failure.
+inline std::uint64_t fileSizeOf(std::FILE* file)
+{
+#ifdef _WIN32
+	const auto position = _ftelli64(file);
+
+	if (position < 0 || _fseeki64(file, 0, SEEK_END) != 0)
+	{
+		return 0;
+	}
+
+	const auto size = _ftelli64(file);
+	_fseeki64(file, position, SEEK_SET);
+#else
+	const auto position = ftello(file);
+
+	if (position < 0 || fseeko(file, 0, SEEK_END) != 0)
+	{
+		return 0;
+	}
+
+	const auto size = ftello(file);
+	fseeko(file, position, SEEK_SET);
+#endif
+
+	return size < 0 ? 0 : static_cast<std::uint64_t>(size);
+}
+
+// Pushes the buffers of file all the way to the disk.
+inline bool syncFile(std::FILE* file)
+{
+	if (std::fflush(file) != 0)
+	{
+		return false;
+	}
+
+#ifdef _WIN32
+	return FlushFileBuffers(reinterpret_cast<HANDLE>(_get_osfhandle(_fileno(file)))) != 0;
+#else
+	return ::fsync(fileno(file)) == 0;
+#endif
+}
+
+// Sets aside size bytes of disk space for file without changing its size, so the file
+// doesn't grow piece by piece. Returns false only if the disk is too full, file systems
+// that can't reserve space just skip it.
+inline bool reserveFileSpace(std::FILE* file, std::uint64_t size)
+{
+#ifdef _WIN32
+	FILE_ALLOCATION_INFO info;
+	info.AllocationSize.QuadPart = static_cast<LONGLONG>(size);
+
+	return SetFileInformationByHandle(reinterpret_cast<HANDLE>(_get_osfhandle(_fileno(file))),
+		FileAllocationInfo, &info, sizeof info) != 0 || GetLastError() != ERROR_DISK_FULL;
+#elif defined(__linux__)
+	return ::fallocate(fileno(file), FALLOC_FL_KEEP_SIZE, 0, static_cast<off_t>(size)) == 0 || errno != ENOSPC;
+#else
+	return true;
+#endif
+}
+
+// Puts source in place of target in one step, target is either still the old file or already the new one.
+inline bool replaceFile(const std::string& source, const std::string& target)
+{
+#ifdef _WIN32
+	return MoveFileExW(toWideString(source).c_str(), toWideString(target).c_str(),
+		MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH) != 0;
+#else
+	return std::rename(source.c_str(), target.c_str()) == 0;
+#endif
+}
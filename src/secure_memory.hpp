@@ -0,0 +1,504 @@
+#pragma once
+
+#ifdef _WIN32
+#include "windows/base.hpp"
+#else
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <unistd.h>
+#endif
+
+#include <cstddef>
+#include <cstdint>
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+#if !defined(_MSC_VER) && !defined(__clang__)
+static_assert(false, "Make sure your compiler honors volatile here.");
+#endif
+
+inline void volatileZeroMemory(volatile void* ptr, std::size_t size)
+{
+	auto bytePtr = static_cast<volatile std::uint8_t*>(ptr);
+
+	// Whole words in between, freeing large locked regions zeroes them.
+	for (; size > 0 && reinterpret_cast<std::uintptr_t>(bytePtr) % sizeof(std::uint64_t) != 0; --size, ++bytePtr)
+	{
+		*bytePtr = 0;
+	}
+
+	auto wordPtr = reinterpret_cast<volatile std::uint64_t*>(bytePtr);
+
+	for (; size >= sizeof(std::uint64_t); size -= sizeof(std::uint64_t), ++wordPtr)
+	{
+		*wordPtr = 0;
+	}
+
+	for (bytePtr = reinterpret_cast<volatile std::uint8_t*>(wordPtr); size-- > 0; ++bytePtr)
+	{
+		*bytePtr = 0;
+	}
+}
+
+class VolatileZeroGuard
+{
+	void* _ptr;
+	std::size_t _size;
+
+public:
+	~VolatileZeroGuard()
+	{
+		volatileZeroMemory(_ptr, _size);
+	}
+
+	VolatileZeroGuard(void* ptr, std::size_t size)
+		: _ptr(ptr)
+		, _size(size)
+	{}
+};
+
+
+inline std::size_t systemPageSize()
+{
+	static const std::size_t pageSize = [] {
+#ifdef _WIN32
+		SYSTEM_INFO info;
+		GetSystemInfo(&info);
+		return static_cast<std::size_t>(info.dwPageSize);
+#else
+		return static_cast<std::size_t>(sysconf(_SC_PAGESIZE));
+#endif
+	}();
+
+	return pageSize;
+}
+
+// Locks pages into memory and keeps track of the quota that limits it. On Windows locked pages
+// count against the minimum working set, which is only about 200 KiB by default, so it gets
+// raised whenever a lock runs into it. Elsewhere the soft RLIMIT_MEMLOCK is raised up to its hard limit.
+class LockedMemory
+{
+	std::mutex _mutex;
+	std::size_t _lockedSize = 0;
+	std::atomic_bool _failed{ false };
+
+public:
+	static LockedMemory& instance()
+	{
+		static LockedMemory lockedMemory;
+		return lockedMemory;
+	}
+
+	// Makes room for size more bytes of locked pages ahead of time.
+	bool reserve(std::size_t size)
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		return growQuota(size);
+	}
+
+	bool lock(void* ptr, std::size_t size)
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+
+		if (!lockPages(ptr, size) && !(growQuota(size) && lockPages(ptr, size)))
+		{
+			_failed = true;
+			return false;
+		}
+
+		_lockedSize += size;
+		return true;
+	}
+
+	void unlock(void* ptr, std::size_t size)
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+
+#ifdef _WIN32
+		if (VirtualUnlock(ptr, size))
+#else
+		if (munlock(ptr, size) == 0)
+#endif
+		{
+			_lockedSize -= std::min(_lockedSize, size);
+		}
+	}
+
+	// True once any pages couldn't be locked, their contents may then end up in the page file.
+	bool failed() const
+	{
+		return _failed;
+	}
+
+private:
+	static bool lockPages(void* ptr, std::size_t size)
+	{
+#ifdef _WIN32
+		return VirtualLock(ptr, size) != 0;
+#else
+		return mlock(ptr, size) == 0;
+#endif
+	}
+
+	// Room for everything locked so far, size more and some slack for the rest of the working set.
+	bool growQuota(std::size_t size)
+	{
+		constexpr std::size_t slack = 1024 * 1024;
+		const auto needed = _lockedSize + size + slack;
+
+#ifdef _WIN32
+		SIZE_T minimum;
+		SIZE_T maximum;
+		DWORD flags;
+
+		if (!GetProcessWorkingSetSizeEx(GetCurrentProcess(), &minimum, &maximum, &flags))
+		{
+			return false;
+		}
+
+		const auto newMinimum = std::max<SIZE_T>(minimum + size, needed);
+		const auto newMaximum = std::max<SIZE_T>(maximum, newMinimum + (maximum - std::min(maximum, minimum)));
+
+		return SetProcessWorkingSetSizeEx(GetCurrentProcess(), newMinimum, newMaximum, flags) != 0;
+#else
+		rlimit limit;
+
+		if (getrlimit(RLIMIT_MEMLOCK, &limit) != 0 || limit.rlim_cur == RLIM_INFINITY)
+		{
+			return false;
+		}
+
+		const auto newLimit = limit.rlim_max == RLIM_INFINITY ? needed : std::min<rlim_t>(limit.rlim_max, needed);
+
+		if (newLimit <= limit.rlim_cur)
+		{
+			return false;
+		}
+
+		limit.rlim_cur = newLimit;
+		return setrlimit(RLIMIT_MEMLOCK, &limit) == 0;
+#endif
+	}
+};
+
+enum class PageLocking
+{
+	NONE, // Big scratch memory, only guarded and zeroed
+	TRY, // Failures are recorded by LockedMemory
+	REQUIRE, // Throws if the pages can't be locked
+};
+
+// Maps size bytes (rounded up to whole pages) between two inaccessible guard pages and, depending on
+// locking, keeps them out of the page file.
+inline void* allocateGuardedPages(std::size_t size, PageLocking locking)
+{
+	const auto pageSize = systemPageSize();
+	const auto usableSize = (size + pageSize - 1) / pageSize * pageSize;
+
+#ifdef _WIN32
+	auto base = static_cast<std::uint8_t*>(VirtualAlloc(nullptr, usableSize + 2 * pageSize, MEM_RESERVE, PAGE_NOACCESS));
+
+	if (base == nullptr)
+	{
+		throw std::bad_alloc();
+	}
+
+	if (VirtualAlloc(base + pageSize, usableSize, MEM_COMMIT, PAGE_READWRITE) == nullptr)
+	{
+		VirtualFree(base, 0, MEM_RELEASE);
+		throw std::bad_alloc();
+	}
+#else
+	auto mapping = mmap(nullptr, usableSize + 2 * pageSize, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+	if (mapping == MAP_FAILED)
+	{
+		throw std::bad_alloc();
+	}
+
+	auto base = static_cast<std::uint8_t*>(mapping);
+
+	if (mprotect(base + pageSize, usableSize, PROT_READ | PROT_WRITE) != 0)
+	{
+		munmap(mapping, usableSize + 2 * pageSize);
+		throw std::bad_alloc();
+	}
+
+#ifdef MADV_DONTDUMP
+	madvise(base + pageSize, usableSize, MADV_DONTDUMP);
+#endif
+#endif
+
+	if (locking != PageLocking::NONE && !LockedMemory::instance().lock(base + pageSize, usableSize)
+		&& locking == PageLocking::REQUIRE)
+	{
+#ifdef _WIN32
+		VirtualFree(base, 0, MEM_RELEASE);
+#else
+		munmap(base, usableSize + 2 * pageSize);
+#endif
+		throw std::runtime_error("Unable to lock memory for secrets.");
+	}
+
+	return base + pageSize;
+}
+
+// Zeroes and unmaps pages returned by allocateGuardedPages(size, locking).
+inline void freeGuardedPages(void* ptr, std::size_t size, PageLocking locking)
+{
+	const auto pageSize = systemPageSize();
+	const auto usableSize = (size + pageSize - 1) / pageSize * pageSize;
+	const auto base = static_cast<std::uint8_t*>(ptr) - pageSize;
+
+	volatileZeroMemory(ptr, size);
+
+	if (locking != PageLocking::NONE)
+	{
+		LockedMemory::instance().unlock(ptr, usableSize);
+	}
+
+#ifdef _WIN32
+	VirtualFree(base, 0, MEM_RELEASE);
+#else
+	munmap(base, usableSize + 2 * pageSize);
+#endif
+}
+
+// Allocator for everything secret, all memory it hands out is locked and zeroed when freed.
+//
+// Small blocks have power of two sizes and are cut from large slabs of locked pages, freed
+// blocks are kept on the free list of their size class. A loaded database thus occupies a few
+// large regions instead of one allocation per string. Larger blocks get their own locked pages.
+class SecureArena
+{
+public:
+	static constexpr std::size_t SLAB_SIZE = 256 * 1024;
+	static constexpr std::size_t MIN_BLOCK_SIZE = 32;
+	static constexpr std::size_t MAX_BLOCK_SIZE = 4096;
+
+private:
+	static constexpr std::size_t N_SIZE_CLASSES = 8;
+
+	static_assert(MIN_BLOCK_SIZE << (N_SIZE_CLASSES - 1) == MAX_BLOCK_SIZE, "Size classes don't cover all blocks.");
+
+	struct FreeBlock
+	{
+		FreeBlock* next;
+	};
+
+	std::mutex _mutex;
+	std::vector<std::uint8_t*> _slabs;
+	std::size_t _slabUsed = SLAB_SIZE; // Bytes handed out from _slabs.back()
+	std::array<FreeBlock*, N_SIZE_CLASSES> _freeLists = {};
+
+public:
+	~SecureArena()
+	{
+		for (auto slab : _slabs)
+		{
+			freeGuardedPages(slab, SLAB_SIZE, PageLocking::TRY);
+		}
+	}
+
+	SecureArena() = default;
+	SecureArena(const SecureArena&) = delete;
+	SecureArena& operator = (const SecureArena&) = delete;
+
+	static SecureArena& instance()
+	{
+		static SecureArena arena;
+		return arena;
+	}
+
+	void* allocate(std::size_t size)
+	{
+		if (size > MAX_BLOCK_SIZE)
+		{
+			return allocateGuardedPages(size, PageLocking::TRY);
+		}
+
+		const auto sizeClass = sizeClassOf(size);
+
+		std::lock_guard<std::mutex> lock(_mutex);
+
+		if (auto block = _freeLists[sizeClass])
+		{
+			_freeLists[sizeClass] = block->next;
+			return block;
+		}
+
+		const auto blockSize = MIN_BLOCK_SIZE << sizeClass;
+
+		if (_slabUsed + blockSize > SLAB_SIZE)
+		{ // The rest of the current slab is too small for this class and stays unused.
+			_slabs.reserve(_slabs.size() + 1);
+			_slabs.push_back(static_cast<std::uint8_t*>(allocateGuardedPages(SLAB_SIZE, PageLocking::TRY)));
+			_slabUsed = 0;
+		}
+
+		auto block = _slabs.back() + _slabUsed;
+		_slabUsed += blockSize;
+		return block;
+	}
+
+	void deallocate(void* ptr, std::size_t size)
+	{
+		if (size > MAX_BLOCK_SIZE)
+		{
+			freeGuardedPages(ptr, size, PageLocking::TRY);
+			return;
+		}
+
+		volatileZeroMemory(ptr, size);
+
+		const auto sizeClass = sizeClassOf(size);
+		auto block = static_cast<FreeBlock*>(ptr);
+
+		std::lock_guard<std::mutex> lock(_mutex);
+		block->next = _freeLists[sizeClass];
+		_freeLists[sizeClass] = block;
+	}
+
+private:
+	static std::size_t sizeClassOf(std::size_t size)
+	{
+		std::size_t sizeClass = 0;
+
+		while ((MIN_BLOCK_SIZE << sizeClass) < size)
+		{
+			++sizeClass;
+		}
+
+		return sizeClass;
+	}
+};
+
+// Allocates from SecureArena::instance(), all instances are interchangeable.
+template <typename T>
+class SecureAllocator
+{
+	static_assert(alignof(T) <= SecureArena::MIN_BLOCK_SIZE, "Blocks are not aligned for T.");
+
+public:
+	typedef T value_type;
+
+	SecureAllocator() = default;
+
+	template <typename U>
+	SecureAllocator(const SecureAllocator<U>&)
+	{}
+
+	T* allocate(std::size_t n)
+	{
+		return static_cast<T*>(SecureArena::instance().allocate(n * sizeof(T)));
+	}
+
+	void deallocate(T* ptr, std::size_t n)
+	{
+		SecureArena::instance().deallocate(ptr, n * sizeof(T));
+	}
+};
+
+template <typename T, typename U>
+bool operator == (const SecureAllocator<T>&, const SecureAllocator<U>&)
+{
+	return true;
+}
+
+template <typename T, typename U>
+bool operator != (const SecureAllocator<T>&, const SecureAllocator<U>&)
+{
+	return false;
+}
+
+// Every allocation gets guarded pages of its own that are zeroed when freed, but not locked.
+// For big scratch memory (e.g. the KDF's) that would use up the lock quota of everything else.
+template <typename T>
+class ScratchAllocator
+{
+public:
+	typedef T value_type;
+
+	ScratchAllocator() = default;
+
+	template <typename U>
+	ScratchAllocator(const ScratchAllocator<U>&)
+	{}
+
+	T* allocate(std::size_t n)
+	{
+		return static_cast<T*>(allocateGuardedPages(n * sizeof(T), PageLocking::NONE));
+	}
+
+	void deallocate(T* ptr, std::size_t n)
+	{
+		freeGuardedPages(ptr, n * sizeof(T), PageLocking::NONE);
+	}
+};
+
+template <typename T, typename U>
+bool operator == (const ScratchAllocator<T>&, const ScratchAllocator<U>&)
+{
+	return true;
+}
+
+template <typename T, typename U>
+bool operator != (const ScratchAllocator<T>&, const ScratchAllocator<U>&)
+{
+	return false;
+}
+
+typedef std::basic_string<char, std::char_traits<char>, SecureAllocator<char>> SecureString;
+
+inline SecureString toSecureString(const std::string& source)
+{
+	return SecureString(source.data(), source.size());
+}
+
+// Also zeroes source, so that no copy is left behind on the heap.
+inline SecureString toSecureString(std::string&& source)
+{
+	SecureString str(source.data(), source.size());
+	volatileZeroMemory(&source[0], source.size()); // &source[0] is always valid.
+	return str;
+}
+
+template <typename T>
+struct SecureDeleter
+{
+	void operator () (T* ptr) const
+	{
+		ptr->~T();
+		freeGuardedPages(ptr, sizeof(T), PageLocking::REQUIRE);
+	}
+};
+
+template <typename T>
+using SecurePtr = std::unique_ptr<T, SecureDeleter<T>>;
+
+// Like std::make_unique, but the object gets pages of its own that are definitely locked
+// (throws otherwise). Meant for the few small secrets everything else depends on.
+template <typename T, typename... Args>
+SecurePtr<T> makeSecure(Args&&... args)
+{
+	auto ptr = allocateGuardedPages(sizeof(T), PageLocking::REQUIRE);
+
+	try
+	{
+		return SecurePtr<T>(new (ptr) T(std::forward<Args>(args)...));
+	}
+	catch (...)
+	{
+		freeGuardedPages(ptr, sizeof(T), PageLocking::REQUIRE);
+		throw;
+	}
+}
@@ -0,0 +1,71 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstddef>
+#include <mutex>
+
+// Lets a fixed group of threads wait for each other at the end of every phase.
+class Barrier
+{
+	std::mutex _m;
+	std::condition_variable _cv;
+	std::size_t _expected;
+	std::size_t _arrived = 0;
+	std::size_t _phase = 0;
+
+public:
+	explicit Barrier(std::size_t participants)
+		: _expected(participants)
+	{}
+
+	Barrier(const Barrier&) = delete;
+	Barrier& operator = (const Barrier&) = delete;
+
+	void arriveAndWait()
+	{
+		auto lock = makeLock();
+		const std::size_t phase = _phase;
+
+		if (!arrive())
+		{
+			_cv.wait(lock, [&] { return _phase != phase; });
+		}
+	}
+
+	// Arrives for the current phase and leaves the group for all later ones.
+	void arriveAndDrop()
+	{
+		auto lock = makeLock();
+		--_expected;
+
+		if (_arrived == _expected && _expected != 0)
+		{
+			completePhase();
+		}
+	}
+
+private:
+	// Returns true if this arrival completed the phase.
+	bool arrive()
+	{
+		if (++_arrived < _expected)
+		{
+			return false;
+		}
+
+		completePhase();
+		return true;
+	}
+
+	void completePhase()
+	{
+		_arrived = 0;
+		++_phase;
+		_cv.notify_all();
+	}
+
+	std::unique_lock<std::mutex> makeLock()
+	{
+		return std::unique_lock<std::mutex>(_m);
+	}
+};
@@ -313,6 +313,25 @@ struct PropertyConverter<T, typename std::enable_if<std::is_convertible<T, std::
 	}
 };
 
+template <typename Allocator>
+struct PropertyConverter<std::basic_string<char, std::char_traits<char>, Allocator>,
+	typename std::enable_if<!std::is_same<Allocator, std::allocator<char>>::value>::type>
+{
+	// Strings with another allocator don't convert to std::string implicitly.
+	typedef std::basic_string<char, std::char_traits<char>, Allocator> String;
+
+	static bool loadValue(String& var, const std::string& value)
+	{
+		var.assign(value.begin(), value.end());
+		return true;
+	}
+
+	static std::string storeValue(const String& value)
+	{
+		return std::string(value.begin(), value.end());
+	}
+};
+
 template <typename T>
 struct PropertyConverter<T, typename std::enable_if<std::is_arithmetic<T>::value>::type>
 {
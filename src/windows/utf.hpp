@@ -49,3 +49,9 @@ std::wstring toWideString(const std::string& sourceString)
 {
 	return toWideString(sourceString.c_str(), sourceString.size());
 }
+
+template <typename Allocator>
+std::wstring toWideString(const std::basic_string<char, std::char_traits<char>, Allocator>& sourceString)
+{
+	return toWideString(sourceString.c_str(), sourceString.size());
+}
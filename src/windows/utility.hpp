@@ -7,6 +7,7 @@
 #include <algorithm>
 #include <atomic>
 #include <memory>
+#include <vector>
 
 struct GlobalMemoryDeleter
 {
@@ -350,6 +351,22 @@ inline std::string getWindowText(HWND hwnd)
 	return toUtf8(buffer);
 }
 
+// Same, but the text only passes through memory from Allocator, e.g. getWindowText<SecureAllocator<char>>().
+template <typename Allocator>
+std::basic_string<char, std::char_traits<char>, Allocator> getWindowText(HWND hwnd)
+{
+	typedef typename std::allocator_traits<Allocator>::template rebind_alloc<wchar_t> WideAllocator;
+
+	std::vector<wchar_t, WideAllocator> buffer(GetWindowTextLengthW(hwnd) + 1, wchar_t());
+	const auto length = GetWindowTextW(hwnd, buffer.data(), static_cast<int>(buffer.size()));
+	const auto size = WideCharToMultiByte(CP_UTF8, 0, buffer.data(), length, nullptr, 0, nullptr, nullptr);
+
+	std::basic_string<char, std::char_traits<char>, Allocator> text(size, char());
+	WideCharToMultiByte(CP_UTF8, 0, buffer.data(), length, &text[0], size, nullptr, nullptr);
+
+	return text;
+}
+
 inline void setWindowText(HWND hwnd, const std::string& windowText)
 {
 	SetWindowTextW(hwnd, toWideString(windowText).c_str());
@@ -372,7 +389,8 @@ inline std::string insertCarriageReturns(const std::string& str)
 	return ret;
 }
 
-inline void copyToClipboard(const std::string& clipboardString)
+template <typename Allocator>
+void copyToClipboard(const std::basic_string<char, std::char_traits<char>, Allocator>& clipboardString)
 {
 	auto wideString = toWideString(clipboardString);
 	auto wideStringBytes = (wideString.size() + 1) * sizeof wideString[0];
@@ -396,6 +414,11 @@ inline void copyToClipboard(const std::string& clipboardString)
 	}
 }
 
+inline void copyToClipboard(const char* clipboardString)
+{
+	copyToClipboard(std::string(clipboardString));
+}
+
 inline std::string copyFromClipboard()
 {
 	ClipboardLock clipboardLock;